@@ -99,6 +99,35 @@ flush_block(void *addr)
         panic("flush_block: sys_page_map: %e\n", r);
 }
 
+// Flush the n blocks starting at blockno, as flush_block would, but
+// clear the PTE_D bits of up to FLUSH_BATCH blocks per system call.
+#define FLUSH_BATCH	32
+
+void
+flush_blocks(uint32_t blockno, uint32_t n)
+{
+	struct PageMapEntry ents[FLUSH_BATCH];
+	uint32_t i;
+	void *addr;
+	int r, m = 0;
+
+	for (i = blockno; i < blockno + n; i++) {
+		addr = diskaddr(i);
+		if (va_is_mapped(addr) && va_is_dirty(addr)) {
+			if ((r = ide_write(i * BLKSECTS, addr, BLKSECTS)) < 0)
+				panic("flush_blocks: ide_write: %e", r);
+			ents[m].pme_srcva = ents[m].pme_dstva = addr;
+			ents[m].pme_perm = uvpt[PGNUM(addr)] & PTE_SYSCALL;
+			m++;
+		}
+		if (m == FLUSH_BATCH || (m > 0 && i == blockno + n - 1)) {
+			if ((r = sys_page_map_batch(0, 0, ents, m)) != m)
+				panic("flush_blocks: sys_page_map_batch: %e", r);
+			m = 0;
+		}
+	}
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
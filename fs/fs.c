@@ -500,8 +500,6 @@ file_flush(struct File *f)
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	flush_blocks(1, super->s_nblocks - 1);
 }
 
@@ -42,8 +42,26 @@ enum {
 enum EnvType {
 	ENV_TYPE_USER = 0,
 	ENV_TYPE_FS,		// File system server
+	ENV_TYPE_PRIV,		// User environment with I/O privilege (tests)
 };
 
+// A range of demand-zero memory, see sys_mmap_anon
+struct AnonRegion {
+	uintptr_t ar_start;		// First address in the region
+	uintptr_t ar_end;		// First address past the region
+	int ar_perm;			// Permissions for pages mapped in it
+};
+
+#define ENV_NANON	8		// Demand-zero regions per environment
+
+// Scheduling weights, see sys_env_set_priority.  Runnable environments
+// share a CPU in proportion to their weights.
+#define ENV_WEIGHT_DEFAULT	100
+#define ENV_WEIGHT_MAX		10000
+
+// CPU affinity masks, see sys_env_set_affinity.  Bit i allows CPU i.
+#define ENV_AFFINITY_ALL	0xffffffff
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -54,8 +72,31 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling
+	struct Env *env_rq_next;	// Next env on its run queue
+	struct Env *env_rq_prev;	// Previous env on its run queue
+	int env_rq_cpu;			// CPU whose run queue holds us, or -1
+	uint32_t env_weight;		// Share of the CPU, see sys_env_set_priority
+	uint32_t env_stride;		// SCHED_STRIDE1 / env_weight
+	uint64_t env_pass;		// Virtual time, advanced by env_stride per run
+	bool env_ipc_boost;		// Woken by an IPC; run it soon
+	uint32_t env_affinity;		// CPUs we may run on
+	uint64_t env_stop_tsc;		// TSC when we last left a CPU
+
+	// Deadline class, see sys_env_set_deadline.  Times are in TSC cycles.
+	uint32_t env_dl_runtime;	// Budget per period, 0 if not in the class
+	uint32_t env_dl_period;		// Minimum time between releases
+	uint32_t env_dl_deadline;	// Relative deadline after a release
+	uint32_t env_dl_bw;		// Admitted share of a CPU, per mille
+	uint64_t env_dl_release;	// TSC at the start of the current period
+	int64_t env_dl_budget;		// Budget left in the current period
+	uint64_t env_dl_dispatch;	// TSC when the budget was last charged
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	struct AnonRegion env_anon[ENV_NANON];	// Demand-zero regions
+	int env_nanon;			// Number of env_anon entries in use
+	uintptr_t env_stack_limit;	// Lowest address the stack may grow to
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
@@ -57,6 +57,19 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+envid_t	sys_fork(void);
+int	sys_page_map_batch(envid_t src_env, envid_t dst_env,
+			   const struct PageMapEntry *ents, size_t n);
+int	sys_page_alloc_range(envid_t env, void *pg, size_t npages, int perm);
+int	sys_page_unmap_range(envid_t env, void *pg, size_t npages);
+int	sys_mmap_anon(envid_t env, void *va, size_t len, int perm);
+int	sys_env_set_stack_limit(envid_t env, size_t size);
+int	sys_env_set_priority(envid_t env, uint32_t weight);
+int	sys_env_set_deadline(envid_t env, uint32_t runtime, uint32_t period,
+			     uint32_t deadline);
+int	sys_env_set_affinity(envid_t env, uint32_t mask);
+uint32_t sys_tsc_khz(void);
+int	sys_sched_set_quantum(uint32_t us);
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -75,7 +88,6 @@ int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -17,6 +17,9 @@
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_CPU0   0x30     // Per-CPU data segment for CPU 0
+// CPU i's TSS and data segment are at GD_TSS0 + (i << 4) and
+// GD_CPU0 + (i << 4): each CPU's data segment follows its TSS.
 
 /*
  * Virtual memory map:                                Permissions
@@ -42,8 +45,10 @@
  *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
  *                     +------------------------------+                   |
  *                     :              .               :                   |
- *                     :              .               :                   |
- *    MMIOLIM ------>  +------------------------------+ 0xefc00000      --+
+ *                     +------------------------------+                   |
+ *                     |   Temporary Mappings (kmap)  | RW/--  KMAPSIZE   |
+ *    MMIOLIM, ----->  +------------------------------+ 0xefc00000      --+
+ *    KMAPBASE
  *                     |       Memory-mapped I/O      | RW/--  PTSIZE
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
@@ -56,8 +61,10 @@
  *                     +------------------------------+ 0xeebff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
  *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
- *                     |      Normal User Stack       | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebfd000
+ *                     |      Normal User Stack       | RW/RW  USTACKSIZE
+ *                     +------------------------------+ (grows on demand)
+ *                     |         Stack Guard          | --/--  USTACKGUARD
+ *                     +------------------------------+
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -101,6 +108,13 @@
 #define MMIOLIM		(KSTACKTOP - PTSIZE)
 #define MMIOBASE	(MMIOLIM - PTSIZE)
 
+// Per-CPU slots where the kernel temporarily maps physical pages that
+// lie beyond the memory mapped at KERNBASE (see kmap), at the bottom of
+// the kernel stack region.
+#define KMAPBASE	MMIOLIM
+#define KMAPSLOTS	4			// Slots per CPU
+#define KMAPSIZE	(NCPU * KMAPSLOTS * PGSIZE)
+
 #define ULIM		(MMIOBASE)
 
 /*
@@ -126,6 +140,13 @@
 // Next page left invalid to guard against exception stack overflow; then:
 // Top of normal user stack
 #define USTACKTOP	(UTOP - 2*PGSIZE)
+// The kernel grows the user stack on demand, down to USTACKSIZE bytes
+// below USTACKTOP by default (see sys_env_set_stack_limit).  Nothing
+// else may be placed in the USTACKGUARD bytes below the limit, so an
+// overflowing stack faults instead of running into other data.
+#define USTACKSIZE	(256*PGSIZE)
+#define USTACKMAX	(16*PTSIZE)
+#define USTACKGUARD	(16*PGSIZE)
 
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
@@ -141,6 +162,12 @@
 // Physical address of startup code for non-boot CPUs (APs)
 #define MPENTRY_PADDR	0x7000
 
+// Where boot/boot.S leaves the BIOS's physical memory map (INT 15h,
+// E820) for the kernel: a 32-bit count, then up to E820_MAX entries.
+#define E820_MAP	0x500
+#define E820_MAX	32
+#define E820_RAM	1		// Entry type of usable memory
+
 #ifndef __ASSEMBLER__
 
 typedef uint32_t pte_t;
@@ -175,9 +202,18 @@ extern volatile pde_t uvpd[];     // VA of current page directory
  * You can map a struct PageInfo * to the corresponding physical address
  * with page2pa() in kern/pmap.h.
  */
+// One entry of the E820 memory map
+struct E820Entry {
+	uint64_t ee_addr;
+	uint64_t ee_len;
+	uint32_t ee_type;
+} __attribute__((packed));
+
 struct PageInfo {
 	// Next page on the free list.
 	struct PageInfo *pp_link;
+	// Previous page on the free list (buddy allocator only).
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -185,6 +221,11 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// If pp_free is set, this page heads a free block of
+	// 2^pp_order pages on one of the buddy allocator's free lists.
+	uint8_t pp_order;
+	uint8_t pp_free;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -17,7 +17,25 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_fork,
+	SYS_page_map_batch,
+	SYS_page_alloc_range,
+	SYS_page_unmap_range,
+	SYS_mmap_anon,
+	SYS_env_set_stack_limit,
+	SYS_env_set_priority,
+	SYS_env_set_deadline,
+	SYS_env_set_affinity,
+	SYS_tsc_khz,
+	SYS_sched_set_quantum,
 	NSYSCALLS
 };
 
+// One mapping for sys_page_map_batch
+struct PageMapEntry {
+	void *pme_srcva;
+	void *pme_dstva;
+	int pme_perm;
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
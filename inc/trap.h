@@ -38,6 +38,8 @@
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_TLBFLUSH    20	// IPI for TLB shootdown, see kern/pmap.c
+#define IRQ_RESCHED     21	// IPI to run sched_yield, see kern/sched.c
 
 #ifndef __ASSEMBLER__
 
@@ -261,4 +261,25 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically add incr to *addr and return the old value of *addr.
+static inline int32_t
+xadd(volatile int32_t *addr, int32_t incr)
+{
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (incr), "+m" (*addr)
+		     :
+		     : "cc");
+	return incr;
+}
+
+static inline uint16_t
+xaddw(volatile uint16_t *addr, uint16_t incr)
+{
+	asm volatile("lock; xaddw %0, %1"
+		     : "+r" (incr), "+m" (*addr)
+		     :
+		     : "cc");
+	return incr;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -9,12 +9,17 @@
 #include <kern/console.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
 
 #include <kern/env.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
+// Protects the console input buffer, and keeps each cprintf's
+// output together on the console.
+struct spinlock cons_lock;
+
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
 delay(void)
@@ -410,12 +415,15 @@ cons_intr(int (*proc)(void))
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
-		if (c == 3) {
+		if (c == 3 && curenv) {
+            env_lock(curenv);
             env_destroy(curenv);
         }
+		spin_lock(&cons_lock);
 		cons.buf[cons.wpos++] = c;
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
+		spin_unlock(&cons_lock);
 	}
 }
 
@@ -432,13 +440,15 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	spin_lock(&cons_lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	spin_unlock(&cons_lock);
+	return c;
 }
 
 // output a character to the console
@@ -454,6 +464,7 @@ cons_putc(int c)
 void
 cons_init(void)
 {
+	__spin_initlock(&cons_lock, "cons_lock");
 	cga_init();
 	kbd_init();
 	serial_init();
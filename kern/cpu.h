@@ -19,9 +19,11 @@ enum {
 
 // Per-CPU state
 struct CpuInfo {
+	struct CpuInfo *cpu_self;       // This CpuInfo; must come first
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
+	pde_t *cpu_pgdir;               // Page directory loaded in %cr3
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
 };
 
@@ -34,13 +36,35 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
-int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+// In the kernel, %gs selects the running CPU's data segment, whose
+// base is its CpuInfo (see env_init_percpu and _alltraps), so finding
+// the CpuInfo takes one load instead of a LAPIC register read.
+static inline struct CpuInfo *
+cpu_this(void)
+{
+	struct CpuInfo *c;
+
+	asm("movl %%gs:0, %0" : "=r" (c));
+	return c;
+}
+
+#define thiscpu (cpu_this())
+
+static inline int
+cpunum(void)
+{
+	return thiscpu->cpu_id;
+}
+
+int lapic_id(void);
 
 void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
+void lapic_timer(uint32_t count);
+uint32_t lapic_timer_count(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int cpu, int vector);
 
 #endif
@@ -14,13 +14,37 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/swap.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+static struct spinlock env_free_lock;	// Protects env_free_list
+static struct spinlock env_locks[NENV];	// Per-env locks, see env_lock()
+
+// Number of environments that are ENV_RUNNABLE, ENV_RUNNING or ENV_DYING.
+volatile int32_t env_nactive;
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
+// Page directories of freed environments (linked by PageInfo->pp_link).
+// env_free only detaches an environment's page directory and queues it
+// on env_reap_list; env_reap frees the user memory behind it a few page
+// tables at a time, on idle CPUs or when memory runs out.
+//
+// Once its user half is empty, a page directory is kept on
+// env_pgdir_pool for reuse by env_setup_vm.  Its kernel half and UVPT
+// entry are still valid, so reusing one costs neither a zero nor a
+// copy.  This relies on kern_pgdir's entries above UTOP not changing
+// once environments exist.  page_alloc empties the pool with
+// env_pgdir_drain when memory runs out.
+#define ENV_PGDIR_POOL_MAX	32
+#define ENV_REAP_BATCH		4	// Page tables freed per env_reap
+static struct PageInfo *env_reap_list;
+static struct PageInfo *env_pgdir_pool;
+static int env_pgdir_npool;
+static struct spinlock env_reap_lock;	// Protects the three above
+
 // Global descriptor table.
 //
 // Set up global descriptor table (GDT) with separate segments for
@@ -36,7 +60,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[2 * NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -54,7 +78,8 @@ struct Segdesc gdt[NCPU + 5] =
 	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
 
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
-	// in trap_init_percpu()
+	// in trap_init_percpu(), per-CPU data segments (starting from
+	// GD_CPU0) in env_init_percpu()
 	[GD_TSS0 >> 3] = SEG_NULL
 };
 
@@ -108,6 +133,58 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+//
+// Lock environment e.  The lock protects e's status, its address
+// space below UTOP, and its IPC state, and keeps e from being freed.
+// The environment running on this CPU (curenv) may read its own
+// fields and touch its own trapframe without taking the lock.
+//
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+// Lock e if nobody holds its lock.  Returns 1 on success.
+bool
+env_trylock(struct Env *e)
+{
+	return spin_trylock(&env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
+//
+// Like envid2env, but also locks the environment on success.
+// The caller must env_unlock() it when done.
+//
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, checkperm)) < 0) {
+		*env_store = 0;
+		return r;
+	}
+
+	env_lock(e);
+	// e may have been freed, and its slot reused, before we got the lock.
+	if (e->env_status == ENV_FREE || (envid != 0 && e->env_id != envid)) {
+		env_unlock(e);
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+
+	*env_store = e;
+	return 0;
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -120,9 +197,13 @@ env_init(void)
 	// Set up envs array
 	// LAB 3: Your code here.
     int i;
+    __spin_initlock(&env_free_lock, "env_free_lock");
+    __spin_initlock(&env_reap_lock, "env_reap_lock");
     for (i = NENV - 1; i >= 0; i--) {
         envs[i].env_id = 0;
         envs[i].env_status = ENV_FREE;
+        envs[i].env_rq_cpu = -1;
+        __spin_initlock(&env_locks[i], "env_lock");
         envs[i].env_link = env_free_list;
         env_free_list = &envs[i];
     }
@@ -135,10 +216,17 @@ env_init(void)
 void
 env_init_percpu(void)
 {
+	int i = lapic_id();
+
+	// GS selects this CPU's data segment, which thiscpu reads
+	// through; _alltraps reloads it on every entry to the kernel.
+	cpus[i].cpu_self = &cpus[i];
+	gdt[(GD_CPU0 >> 3) + (i << 1)] = SEG16(STA_W, (uint32_t) &cpus[i],
+					       sizeof(struct CpuInfo) - 1, 0);
 	lgdt(&gdt_pd);
-	// The kernel never uses GS or FS, so we leave those set to
-	// the user data segment.
-	asm volatile("movw %%ax,%%gs" : : "a" (GD_UD|3));
+	asm volatile("movw %%ax,%%gs" : : "a" (GD_CPU0 + (i << 4)));
+	// The kernel never uses FS, so we leave it set to the user
+	// data segment.
 	asm volatile("movw %%ax,%%fs" : : "a" (GD_UD|3));
 	// The kernel does use ES, DS, and SS.  We'll change between
 	// the kernel and user data segments as needed.
@@ -168,8 +256,23 @@ env_setup_vm(struct Env *e)
 	int i;
 	struct PageInfo *p = NULL;
 
-	// Allocate a page for the page directory
-	if (!(p = page_alloc(ALLOC_ZERO)))
+	// Reuse a page directory from a freed environment if we can.
+	spin_lock(&env_reap_lock);
+	if ((p = env_pgdir_pool)) {
+		env_pgdir_pool = p->pp_link;
+		env_pgdir_npool--;
+	}
+	spin_unlock(&env_reap_lock);
+	if (p) {
+		p->pp_link = NULL;
+		e->env_pgdir = (pde_t *) page2kva(p);
+		page_incref(p);
+		return 0;
+	}
+
+	// Allocate a page for the page directory.  No need to zero it,
+	// since all of it is copied from kern_pgdir below.
+	if (!(p = page_alloc(0)))
 		return -E_NO_MEM;
 
 	// Now, set e->env_pgdir and initialize the page directory.
@@ -190,7 +293,7 @@ env_setup_vm(struct Env *e)
 
 	// LAB 3: Your code here.
 	e->env_pgdir = (pde_t *) page2kva(p);
-	p->pp_ref++;
+	page_incref(p);
 
     memcpy(e->env_pgdir, kern_pgdir, PGSIZE);
 
@@ -224,12 +327,24 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_free_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_free_lock);
 		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_free_lock);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	// page_alloc may reap, drain the page directory pool, or swap,
+	// so it runs without env_free_lock; give e back if it fails.
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_free_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_free_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -240,8 +355,18 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	e->env_status = ENV_NOT_RUNNABLE;	// The caller marks us runnable
 	e->env_runs = 0;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	e->env_rq_cpu = -1;
+	e->env_weight = ENV_WEIGHT_DEFAULT;
+	e->env_stride = SCHED_STRIDE1 / ENV_WEIGHT_DEFAULT;
+	e->env_pass = 0;
+	e->env_ipc_boost = 0;
+	e->env_affinity = ENV_AFFINITY_ALL;
+	e->env_stop_tsc = 0;
+	e->env_dl_runtime = e->env_dl_period = e->env_dl_deadline = 0;
+	e->env_dl_bw = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -276,8 +401,10 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
-	// commit the allocation
-	env_free_list = e->env_link;
+	// No demand-zero regions until the user asks for some.
+	e->env_nanon = 0;
+	e->env_stack_limit = USTACKTOP - USTACKSIZE;
+
 	*newenv_store = e;
 
     cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -307,7 +434,7 @@ region_alloc(struct Env *e, void *va, size_t len)
     uintptr_t va_end = ROUNDUP((uintptr_t) va + len, PGSIZE);
 
     for (uintptr_t va_cur = va_start; va_cur < va_end; va_cur += PGSIZE) {
-        struct PageInfo *pp = page_alloc(0);
+        struct PageInfo *pp = page_alloc(ALLOC_HIGHMEM);
         if (!pp)
             panic("region_alloc: cannot allocate physical memory");
         int res = page_insert(e->env_pgdir, pp, (void *) va_cur, PTE_U | PTE_W);
@@ -377,15 +504,28 @@ load_icode(struct Env *e, uint8_t *binary)
     struct Proghdr *ph = (struct Proghdr *) ((uint8_t *) elf + elf->e_phoff);
     struct Proghdr *eph = ph + elf->e_phnum;
 
-    lcr3(PADDR(e->env_pgdir));
+    pgdir_load(e->env_pgdir);
 
     for (; ph < eph; ph++) {
         if (ph->p_type == ELF_PROG_LOAD) {
             if (ph->p_memsz < ph->p_filesz)
                 panic("load_icode: ph->p_memsz < ph->p_filesz\n");
-            region_alloc(e, (void *) ph->p_va, ph->p_memsz);
-            memset((void *) ph->p_va, 0, ph->p_memsz);
-            memcpy((void *) ph->p_va, (void *) ((uint8_t *) binary + ph->p_offset), ph->p_filesz);
+            // Whole pages of bss past the file data are left
+            // demand-zero (see page_anon_fault), if we have a region.
+            uintptr_t file_end = ROUNDUP(ph->p_va + ph->p_filesz, PGSIZE);
+            uintptr_t mem_end = ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE);
+            if (mem_end > file_end && e->env_nanon < ENV_NANON) {
+                struct AnonRegion *ar = &e->env_anon[e->env_nanon++];
+                ar->ar_start = file_end;
+                ar->ar_end = mem_end;
+                ar->ar_perm = PTE_P | PTE_U | PTE_W;
+                mem_end = file_end;
+            }
+            if (mem_end > ph->p_va) {
+                region_alloc(e, (void *) ph->p_va, mem_end - ph->p_va);
+                memset((void *) ph->p_va, 0, mem_end - ph->p_va);
+                memcpy((void *) ph->p_va, (void *) ((uint8_t *) binary + ph->p_offset), ph->p_filesz);
+            }
         }
     }
 
@@ -394,7 +534,7 @@ load_icode(struct Env *e, uint8_t *binary)
     region_alloc(e, (void *) (USTACKTOP - PGSIZE), PGSIZE);
 
 	// LAB 3: Your code here.
-    lcr3(PADDR(kern_pgdir));
+    pgdir_load(kern_pgdir);
     e->env_tf.tf_eip = elf->e_entry;
 }
 
@@ -414,72 +554,210 @@ env_create(uint8_t *binary, enum EnvType type)
     if (res == 0) {
         newenv_store->env_type = type;
         load_icode(newenv_store, binary);
+        env_lock(newenv_store);
+        env_set_status(newenv_store, ENV_RUNNABLE);
+        env_unlock(newenv_store);
     } else {
         panic("env_create: %e", res);
     }
 
 	// If this is the file server (type == ENV_TYPE_FS) give it I/O privileges.
+	// So do tests of privileged system calls (type == ENV_TYPE_PRIV).
 	// LAB 5: Your code here.
-	if (type == ENV_TYPE_FS) {
+	if (type == ENV_TYPE_FS || type == ENV_TYPE_PRIV) {
 	    newenv_store->env_tf.tf_eflags |= FL_IOPL_MASK;
 	}
 }
 
 //
-// Frees env e and all memory it uses.
+// Frees env e.  The memory it uses is freed later by env_reap.
+// The caller must hold e's lock.
 //
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
-	physaddr_t pa;
+	struct PageInfo *pp;
 
 	// If freeing the current environment, switch to kern_pgdir
-	// before freeing the page directory, just in case the page
+	// before queueing the page directory, just in case the page
 	// gets reused.
 	if (e == curenv)
-		lcr3(PADDR(kern_pgdir));
+		pgdir_load(kern_pgdir);
 
 	// Note the environment's demise.
     cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
+	// Give back any CPU time reserved for the deadline class
+	if (e->env_dl_runtime)
+		sched_set_deadline(e, 0, 0, 0);
+
+	// Detach the page directory and leave the rest to env_reap
+	pp = pa2page(PADDR(e->env_pgdir));
+	e->env_pgdir = 0;
+	spin_lock(&env_reap_lock);
+	pp->pp_link = env_reap_list;
+	env_reap_list = pp;
+	spin_unlock(&env_reap_lock);
+
+	// return the environment to the free list
+	env_set_status(e, ENV_FREE);
+	spin_lock(&env_free_lock);
+	e->env_link = env_free_list;
+	env_free_list = e;
+	spin_unlock(&env_free_lock);
+}
+
+//
+// Frees every page directory kept on env_pgdir_pool.  Called by
+// page_alloc when memory runs out, before it resorts to swapping.
+//
+// Returns 1 if there was anything to free, 0 otherwise.
+//
+bool
+env_pgdir_drain(void)
+{
+	struct PageInfo *pp, *next;
+
+	spin_lock(&env_reap_lock);
+	pp = env_pgdir_pool;
+	env_pgdir_pool = NULL;
+	env_pgdir_npool = 0;
+	spin_unlock(&env_reap_lock);
+	if (!pp)
+		return 0;
+	for (; pp; pp = next) {
+		next = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+	return 1;
+}
+
+// Frees up to ENV_REAP_BATCH page tables, and the pages they map, of a
+// page directory queued by env_free.  Once the user half of the page
+// directory is empty, keeps it for the next env_alloc or frees it.
+// Called by idle CPUs, and by page_alloc when memory runs out.
+//
+// Returns 1 if there was anything to free, 0 otherwise.
+//
+bool
+env_reap(void)
+{
+	struct PageInfo *pp, **tail;
+	pde_t *pgdir;
+	pte_t *pt;
+	uint32_t pdeno, pteno;
+	int n = 0;
+
+	spin_lock(&env_reap_lock);
+	if ((pp = env_reap_list))
+		env_reap_list = pp->pp_link;
+	spin_unlock(&env_reap_lock);
+	if (!pp)
+		return 0;
+
+	// No CPU has this page directory loaded any more, so there is
+	// nothing to invalidate in the TLB.
 	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+	pgdir = (pde_t *) page2kva(pp);
+	for (pdeno = 0; pdeno < PDX(UTOP) && n < ENV_REAP_BATCH; pdeno++) {
 
 		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
+		if (!(pgdir[pdeno] & PTE_P))
 			continue;
 
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
 		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
+		pt = (pte_t *) KADDR(PTE_ADDR(pgdir[pdeno]));
+		for (pteno = 0; pteno <= PTX(~0); pteno++)
 			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-		}
+				page_decref(pa2page(PTE_ADDR(pt[pteno])));
+			else if (PTE_SWAPPED(pt[pteno]))
+				swap_slot_free(pt[pteno]);
 
 		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
+		page_decref(pa2page(PTE_ADDR(pgdir[pdeno])));
+		pgdir[pdeno] = 0;
+		n++;
 	}
 
-	// free the page directory
-	pa = PADDR(e->env_pgdir);
-	e->env_pgdir = 0;
-	page_decref(pa2page(pa));
+	// A CPU that ran the environment last may not have switched
+	// away from its page directory yet, and still walks the kernel
+	// half of it.  Wait for it before letting the page go, and
+	// let the other queued page directories go first meanwhile.
+	if (pdeno >= PDX(UTOP) && pgdir_loaded(pgdir)) {
+		spin_lock(&env_reap_lock);
+		for (tail = &env_reap_list; *tail; tail = &(*tail)->pp_link)
+			/* do nothing */;
+		pp->pp_link = NULL;
+		*tail = pp;
+		spin_unlock(&env_reap_lock);
+		return n > 0;
+	}
 
-	// return the environment to the free list
-	e->env_status = ENV_FREE;
-	e->env_link = env_free_list;
-	env_free_list = e;
+	spin_lock(&env_reap_lock);
+	if (pdeno < PDX(UTOP)) {
+		// More to do next time
+		pp->pp_link = env_reap_list;
+		env_reap_list = pp;
+		pp = NULL;
+	} else if (pp->pp_ref == 1 && env_pgdir_npool < ENV_PGDIR_POOL_MAX) {
+		pp->pp_ref = 0;
+		pp->pp_link = env_pgdir_pool;
+		env_pgdir_pool = pp;
+		env_pgdir_npool++;
+		pp = NULL;
+	}
+	spin_unlock(&env_reap_lock);
+	if (pp) {
+		pp->pp_link = NULL;
+		page_decref(pp);
+	}
+	return 1;
+}
+
+#define ENV_ACTIVE(status) \
+	((status) == ENV_RUNNABLE || (status) == ENV_RUNNING || (status) == ENV_DYING)
+
+//
+// Change e's status, keeping the scheduler's run queues in step:
+// an environment is on a run queue exactly when it is ENV_RUNNABLE.
+// The caller must hold e's lock.
+//
+// If curenv gives up the CPU by becoming runnable or not runnable,
+// another CPU may pick it up as soon as we drop its lock, so we stop
+// using its address space and clear curenv here.
+//
+void
+env_set_status(struct Env *e, unsigned status)
+{
+	if (ENV_ACTIVE(e->env_status) && !ENV_ACTIVE(status))
+		xadd(&env_nactive, -1);
+	else if (!ENV_ACTIVE(e->env_status) && ENV_ACTIVE(status))
+		xadd(&env_nactive, 1);
+
+	if (e->env_status == ENV_RUNNING && status != ENV_RUNNING)
+		sched_stop(e);
+
+	if (e == curenv && (status == ENV_RUNNABLE || status == ENV_NOT_RUNNABLE)) {
+		pgdir_load(kern_pgdir);
+		curenv = NULL;
+	}
+
+	if (e->env_status == ENV_RUNNABLE && status != ENV_RUNNABLE)
+		sched_dequeue(e);
+	if (e->env_status != ENV_RUNNABLE && status == ENV_RUNNABLE) {
+		bool wakeup = e->env_status != ENV_RUNNING;
+
+		e->env_status = status;
+		sched_enqueue(e, wakeup);
+		return;
+	}
+	e->env_status = status;
 }
 
 //
 // Frees environment e.
+// The caller must hold e's lock, which env_destroy releases.
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
 //
@@ -489,12 +767,17 @@ env_destroy(struct Env *e)
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	if (curenv != e &&
+	    (e->env_status == ENV_RUNNING || e->env_status == ENV_DYING)) {
+		env_set_status(e, ENV_DYING);
+		// Its CPU may have its timer off, see sched_run
+		sched_preempt(e);
+		env_unlock(e);
 		return;
 	}
 
 	env_free(e);
+	env_unlock(e);
 
 	if (curenv == e) {
 		curenv = NULL;
@@ -553,15 +836,26 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-	if (curenv && curenv->env_status == ENV_RUNNING)
-	    curenv->env_status = ENV_RUNNABLE;
+	//
+	// The scheduler has already marked e ENV_RUNNING under its lock,
+	// so no other CPU will pick it.  Switch to e's address space
+	// before giving up the previous environment, which another CPU
+	// may then run or free.
+	struct Env *prev = curenv;
 
 	curenv = e;
-    curenv->env_status = ENV_RUNNING;
     curenv->env_runs++;
+    pgdir_load(curenv->env_pgdir);
+
+    if (prev && prev != e) {
+        env_lock(prev);
+        if (prev->env_status == ENV_RUNNING)
+            env_set_status(prev, ENV_RUNNABLE);
+        else if (prev->env_status == ENV_DYING)
+            env_free(prev);
+        env_unlock(prev);
+    }
 
-    unlock_kernel();
-    lcr3(PADDR(curenv->env_pgdir));
     env_pop_tf(&(curenv->env_tf));
 
 //	panic("env_run not yet implemented");
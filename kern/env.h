@@ -7,6 +7,7 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
+extern volatile int32_t env_nactive;	// Runnable, running or dying envs
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
@@ -14,10 +15,18 @@ void	env_init(void);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
+bool	env_reap(void);
+bool	env_pgdir_drain(void);
 void	env_create(uint8_t *binary, enum EnvType type);
-void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_destroy(struct Env *e);	// Releases e's lock; does not return
+					// if e == curenv
+void	env_set_status(struct Env *e, unsigned status);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm);
+void	env_lock(struct Env *e);
+bool	env_trylock(struct Env *e);
+void	env_unlock(struct Env *e);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
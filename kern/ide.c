@@ -0,0 +1,129 @@
+/*
+ * Minimal PIO-based (non-interrupt-driven) IDE driver for the kernel's
+ * own disk, the master on the secondary channel.  The file system
+ * environment drives the primary channel itself (see fs/ide.c), so
+ * the two never share a controller.
+ */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+
+#include <kern/ide.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+
+#define IDE_IO		0x170	// Secondary channel command block
+#define IDE_DATA	(IDE_IO + 0)
+#define IDE_NSECT	(IDE_IO + 2)
+#define IDE_LBA0	(IDE_IO + 3)
+#define IDE_LBA1	(IDE_IO + 4)
+#define IDE_LBA2	(IDE_IO + 5)
+#define IDE_DRIVE	(IDE_IO + 6)
+#define IDE_CMD		(IDE_IO + 7)	// Status on read
+
+#define IDE_BSY		0x80
+#define IDE_DRDY	0x40
+#define IDE_DF		0x20
+#define IDE_DRQ		0x08
+#define IDE_ERR		0x01
+
+#define IDE_CMD_READ	0x20
+#define IDE_CMD_WRITE	0x30
+#define IDE_CMD_IDENTIFY 0xEC
+
+static struct spinlock ide_lock;	// Serializes use of the channel
+static uint32_t ide_nsecs;		// Size of the disk, 0 if none
+
+static int
+ide_wait_ready(bool check_error)
+{
+	int r;
+
+	// Other CPUs may wait for this one while it polls the disk.
+	while (((r = inb(IDE_CMD)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
+		tlb_shootdown_poll();
+
+	if (check_error && (r & (IDE_DF|IDE_ERR)) != 0)
+		return -1;
+	return 0;
+}
+
+//
+// Look for the disk and return its size in sectors, or 0 if there
+// is no disk.
+//
+uint32_t
+ide_init(void)
+{
+	uint32_t id[128];
+	int r = 0, x;
+
+	__spin_initlock(&ide_lock, "ide_lock");
+
+	outb(IDE_DRIVE, 0xE0);
+	outb(IDE_CMD, IDE_CMD_IDENTIFY);
+
+	// No drive leaves the status at 0, or floating at 0xFF
+	for (x = 0; x < 100000 && ((r = inb(IDE_CMD)) & IDE_BSY) && r != 0xFF; x++)
+		/* do nothing */;
+	if (r == 0 || r == 0xFF || (r & (IDE_ERR|IDE_DF)) || !(r & IDE_DRQ))
+		return 0;
+
+	insl(IDE_DATA, id, ARRAY_SIZE(id));
+	// Words 60 and 61 hold the number of 28-bit LBA sectors
+	ide_nsecs = id[30];
+	return ide_nsecs;
+}
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r = 0;
+
+	assert(nsecs <= 256 && secno + nsecs <= ide_nsecs);
+
+	spin_lock(&ide_lock);
+	ide_wait_ready(0);
+
+	outb(IDE_NSECT, nsecs);
+	outb(IDE_LBA0, secno & 0xFF);
+	outb(IDE_LBA1, (secno >> 8) & 0xFF);
+	outb(IDE_LBA2, (secno >> 16) & 0xFF);
+	outb(IDE_DRIVE, 0xE0 | ((secno>>24)&0x0F));
+	outb(IDE_CMD, IDE_CMD_READ);
+
+	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
+		if ((r = ide_wait_ready(1)) < 0)
+			break;
+		insl(IDE_DATA, dst, SECTSIZE/4);
+	}
+	spin_unlock(&ide_lock);
+	return r;
+}
+
+int
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	int r = 0;
+
+	assert(nsecs <= 256 && secno + nsecs <= ide_nsecs);
+
+	spin_lock(&ide_lock);
+	ide_wait_ready(0);
+
+	outb(IDE_NSECT, nsecs);
+	outb(IDE_LBA0, secno & 0xFF);
+	outb(IDE_LBA1, (secno >> 8) & 0xFF);
+	outb(IDE_LBA2, (secno >> 16) & 0xFF);
+	outb(IDE_DRIVE, 0xE0 | ((secno>>24)&0x0F));
+	outb(IDE_CMD, IDE_CMD_WRITE);
+
+	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
+		if ((r = ide_wait_ready(1)) < 0)
+			break;
+		outsl(IDE_DATA, src, SECTSIZE/4);
+	}
+	spin_unlock(&ide_lock);
+	return r;
+}
@@ -7,6 +7,9 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/swap.h>
+#include <kern/merge.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
@@ -17,10 +20,19 @@
 
 static void boot_aps(void);
 
+// Set once the boot CPU has created the initial environments.  Until
+// then the APs must stay out of the scheduler, or they would find
+// nothing to run and drop into the monitor.
+static volatile uint32_t sched_started;
+
 
 void
 i386_init(void)
 {
+	// Everything from locks on uses thiscpu, so set up its segment
+	// before anything else.
+	env_init_percpu();
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
@@ -29,9 +41,13 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kmem_init();
+	swap_init();
+	merge_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	sched_init();
 	trap_init();
 
 	// Lab 4 multiprocessor initialization functions
@@ -40,10 +56,8 @@ i386_init(void)
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
-
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-    lock_kernel();
+	kclock_init();
+	sched_timer_init();
 
 	// Starting non-boot CPUs
 	boot_aps();
@@ -52,8 +66,11 @@ i386_init(void)
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
 #if defined(TEST)
+#if !defined(TEST_TYPE)
+#define TEST_TYPE ENV_TYPE_USER
+#endif
 	// Don't touch -- used by grading script!
-	ENV_CREATE(TEST, ENV_TYPE_USER);
+	ENV_CREATE(TEST, TEST_TYPE);
 #else
 	// Touch all you want.
 	ENV_CREATE(user_spawnfaultio, ENV_TYPE_USER);
@@ -69,6 +86,9 @@ i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+	// Let the APs into the scheduler now that there is work to do.
+	xchg(&sched_started, 1);
+
 	// Schedule and run the first user environment!
 	sched_yield();
 }
@@ -109,21 +129,23 @@ boot_aps(void)
 void
 mp_main(void)
 {
-	// We are in high EIP now, safe to switch to kern_pgdir 
+	// We are in high EIP now, safe to switch to kern_pgdir.  Only
+	// kern_pgdir maps the LAPIC, which env_init_percpu needs to set
+	// up thiscpu, which pgdir_load uses.
+	mem_init_percpu();
 	lcr3(PADDR(kern_pgdir));
+	env_init_percpu();
+	pgdir_load(kern_pgdir);
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
-	env_init_percpu();
 	trap_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-    lock_kernel();
+	// to start running processes on this CPU.
+	while (!sched_started)
+		asm volatile("pause");
     sched_yield();
 
 	// Remove this after you finish Exercise 6
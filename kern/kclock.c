@@ -1,11 +1,20 @@
 /* See COPYRIGHT for copyright information. */
 
-/* Support for reading the NVRAM from the real-time clock. */
+/* Support for reading the NVRAM from the real-time clock, and for
+ * measuring the CPU's clock rates against the PIT. */
 
 #include <inc/x86.h>
+#include <inc/stdio.h>
 
 #include <kern/kclock.h>
+#include <kern/cpu.h>
 
+#define KCLOCK_CALIBRATE_MS	10		// Length of the PIT interval
+// What QEMU usually provides, in case the PIT does not count
+#define KCLOCK_DEFAULT_HZ	1000000000
+
+uint64_t kclock_tsc_hz;
+uint32_t kclock_lapic_hz;
 
 unsigned
 mc146818_read(unsigned reg)
@@ -20,3 +29,45 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC, reg);
 	outb(IO_RTC+1, datum);
 }
+
+// Measure the TSC and LAPIC timer rates against the PIT, whose input
+// clock is fixed, by counting how far each gets while PIT channel 2
+// counts down KCLOCK_CALIBRATE_MS.  Every CPU is assumed to run at the
+// boot CPU's rates.  Call after lapic_init.
+void
+kclock_init(void)
+{
+	uint32_t latch = PIT_HZ / (1000 / KCLOCK_CALIBRATE_MS);
+	uint32_t lapic0, lapic1, n = 0;
+	uint64_t tsc0, tsc1;
+
+	// Gate channel 2 on with the speaker off, and load it in mode 0,
+	// which raises its output once the count reaches zero.
+	outb(IO_PIT_GATE, (inb(IO_PIT_GATE) & ~0x02) | 0x01);
+	outb(IO_PIT_MODE, 0xb0);
+	outb(IO_PIT_CH2, latch & 0xff);
+	outb(IO_PIT_CH2, latch >> 8);
+
+	lapic_timer(0xffffffff);
+	tsc0 = read_tsc();
+	lapic0 = lapic_timer_count();
+	while (!(inb(IO_PIT_GATE) & 0x20) && ++n < 100000000)
+		/* do nothing */;
+	tsc1 = read_tsc();
+	lapic1 = lapic_timer_count();
+	lapic_timer(0);
+
+	if (!(inb(IO_PIT_GATE) & 0x20)) {
+		cprintf("kclock: PIT does not count, assuming %u Hz clocks\n",
+			KCLOCK_DEFAULT_HZ);
+		kclock_tsc_hz = kclock_lapic_hz = KCLOCK_DEFAULT_HZ;
+		return;
+	}
+	kclock_tsc_hz = (tsc1 - tsc0) * 1000 / KCLOCK_CALIBRATE_MS;
+	// The LAPIC timer counts down
+	kclock_lapic_hz = (lapic0 - lapic1) * (1000 / KCLOCK_CALIBRATE_MS);
+	if (!kclock_lapic_hz)
+		kclock_lapic_hz = KCLOCK_DEFAULT_HZ;
+	cprintf("kclock: TSC %u kHz, LAPIC timer %u kHz\n",
+		(uint32_t) (kclock_tsc_hz / 1000), kclock_lapic_hz / 1000);
+}
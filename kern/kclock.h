@@ -6,6 +6,8 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 #define	IO_RTC		0x070		/* RTC port */
 
 #define	MC_NVRAM_START	0xe	/* start of NVRAM: offset 14 */
@@ -23,7 +25,17 @@
 #define NVRAM_EXT16LO	(MC_NVRAM_START + 38)	/* low byte; RTC off. 0x34 */
 #define NVRAM_EXT16HI	(MC_NVRAM_START + 39)	/* high byte; RTC off. 0x35 */
 
+#define	IO_PIT_CH2	0x042		/* 8253 PIT channel 2 counter */
+#define	IO_PIT_MODE	0x043		/* 8253 PIT mode/command register */
+#define	IO_PIT_GATE	0x061		/* Channel 2 gate and output */
+#define	PIT_HZ		1193182		/* PIT input clock */
+
+// Clock rates measured by kclock_init.
+extern uint64_t kclock_tsc_hz;		// TSC increments per second
+extern uint32_t kclock_lapic_hz;	// LAPIC timer counts per second
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
+void kclock_init(void);
 
 #endif	// !JOS_KERN_KCLOCK_H
@@ -0,0 +1,367 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Kernel heap.  Small objects come from caches of equally sized
+// objects (kmem_cache_create), each carved out of one-page slabs that
+// start with a struct KmemSlab.  kmalloc picks the smallest of a set
+// of power-of-two caches; larger requests get a block of pages from
+// page_alloc_order with the same header, so kfree can tell the two
+// apart by looking at the start of the object's page.
+//
+// As with the page magazines, each CPU allocates from and frees to its
+// own KmemMagazine in every cache without locking, and moves objects
+// to or from the slabs KMEM_MAG_BATCH at a time.
+
+struct KmemSlab {
+	struct KmemCache *ks_cache;	// NULL for a large kmalloc block
+	struct KmemSlab *ks_next;	// Links on kc_partial
+	struct KmemSlab *ks_prev;
+	void *ks_free;			// Free objects, linked at kc_linkoff
+	int ks_inuse;			// Objects handed out from this slab
+	int ks_order;			// Size of a large block
+};
+
+#define KMEM_HDRSIZE	ROUNDUP(sizeof(struct KmemSlab), 16)
+
+#define KMALLOC_MIN	16
+#define KMALLOC_NCACHES	7		// KMALLOC_MIN up to KMEM_MAX_SIZE
+
+struct KmemCache *kmem_caches;
+static struct spinlock kmem_lock;	// Protects kmem_caches
+static struct KmemCache *kmalloc_caches[KMALLOC_NCACHES];
+static const char *kmalloc_names[KMALLOC_NCACHES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024"
+};
+
+static void check_kmalloc(void);
+
+static void **
+kmem_link(struct KmemCache *c, void *obj)
+{
+	return (void **) ((char *) obj + c->kc_linkoff);
+}
+
+static struct KmemSlab *
+kmem_slab_of(void *obj)
+{
+	return (struct KmemSlab *) ROUNDDOWN(obj, PGSIZE);
+}
+
+static void
+kmem_partial_insert(struct KmemCache *c, struct KmemSlab *s)
+{
+	s->ks_prev = NULL;
+	s->ks_next = c->kc_partial;
+	if (c->kc_partial)
+		c->kc_partial->ks_prev = s;
+	c->kc_partial = s;
+}
+
+static void
+kmem_partial_remove(struct KmemCache *c, struct KmemSlab *s)
+{
+	if (s->ks_prev)
+		s->ks_prev->ks_next = s->ks_next;
+	else
+		c->kc_partial = s->ks_next;
+	if (s->ks_next)
+		s->ks_next->ks_prev = s->ks_prev;
+	s->ks_next = s->ks_prev = NULL;
+}
+
+// Allocate a new slab for c and construct all of its objects.
+// Called without c's lock held, since the constructor may take time.
+static struct KmemSlab *
+kmem_slab_alloc(struct KmemCache *c)
+{
+	struct PageInfo *pp;
+	struct KmemSlab *s;
+	char *obj;
+	int i;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	s = (struct KmemSlab *) page2kva(pp);
+	s->ks_cache = c;
+	s->ks_next = s->ks_prev = NULL;
+	s->ks_free = NULL;
+	s->ks_inuse = 0;
+	s->ks_order = 0;
+	for (i = c->kc_perslab - 1; i >= 0; i--) {
+		obj = (char *) s + KMEM_HDRSIZE + i * c->kc_stride;
+		if (c->kc_ctor)
+			c->kc_ctor(obj);
+		*kmem_link(c, obj) = s->ks_free;
+		s->ks_free = obj;
+	}
+	return s;
+}
+
+// Move up to KMEM_MAG_BATCH objects from c's slabs to m,
+// allocating a new slab if necessary.
+static void
+kmem_mag_refill(struct KmemCache *c, struct KmemMagazine *m)
+{
+	struct KmemSlab *s;
+	void *obj;
+
+	spin_lock(&c->kc_lock);
+	while (m->km_count < KMEM_MAG_BATCH) {
+		if (!(s = c->kc_partial)) {
+			spin_unlock(&c->kc_lock);
+			s = kmem_slab_alloc(c);
+			spin_lock(&c->kc_lock);
+			if (!s)
+				break;
+			c->kc_nslabs++;
+			kmem_partial_insert(c, s);
+		}
+		obj = s->ks_free;
+		s->ks_free = *kmem_link(c, obj);
+		if (++s->ks_inuse == c->kc_perslab)
+			kmem_partial_remove(c, s);
+		m->km_objs[m->km_count++] = obj;
+	}
+	spin_unlock(&c->kc_lock);
+}
+
+// Move KMEM_MAG_BATCH objects from m back to their slabs.  A slab
+// that becomes empty is freed, unless it is the only one with room.
+static void
+kmem_mag_drain(struct KmemCache *c, struct KmemMagazine *m)
+{
+	struct KmemSlab *s;
+	void *obj;
+	int i;
+
+	spin_lock(&c->kc_lock);
+	for (i = 0; i < KMEM_MAG_BATCH && m->km_count > 0; i++) {
+		obj = m->km_objs[--m->km_count];
+		s = kmem_slab_of(obj);
+		if (s->ks_inuse-- == c->kc_perslab)
+			kmem_partial_insert(c, s);
+		*kmem_link(c, obj) = s->ks_free;
+		s->ks_free = obj;
+		if (s->ks_inuse == 0 && (s->ks_prev || s->ks_next)) {
+			kmem_partial_remove(c, s);
+			c->kc_nslabs--;
+			page_free(pa2page(PADDR(s)));
+		}
+	}
+	spin_unlock(&c->kc_lock);
+}
+
+//
+// Create a cache of objects of 'size' bytes, at most KMEM_MAX_SIZE.
+// If ctor is not NULL, it is run on every object when its slab is
+// allocated, and objects must be in their constructed state again
+// when they are freed, so kmem_cache_alloc need not construct them.
+//
+// Returns NULL if out of memory.
+//
+struct KmemCache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *))
+{
+	struct KmemCache *c;
+
+	assert(size > 0 && size <= KMEM_MAX_SIZE);
+	if (!(c = kmalloc(sizeof(struct KmemCache))))
+		return NULL;
+	memset(c, 0, sizeof(struct KmemCache));
+	c->kc_name = name;
+	c->kc_size = size;
+	c->kc_ctor = ctor;
+	// A free object normally keeps its link in its first word, but a
+	// constructed object must not be overwritten, so give it its own.
+	if (ctor) {
+		c->kc_linkoff = ROUNDUP(size, sizeof(void *));
+		c->kc_stride = ROUNDUP(c->kc_linkoff + sizeof(void *), 8);
+	} else {
+		c->kc_linkoff = 0;
+		c->kc_stride = ROUNDUP(MAX(size, sizeof(void *)), 8);
+	}
+	c->kc_perslab = (PGSIZE - KMEM_HDRSIZE) / c->kc_stride;
+	__spin_initlock(&c->kc_lock, "kc_lock");
+
+	spin_lock(&kmem_lock);
+	c->kc_next = kmem_caches;
+	kmem_caches = c;
+	spin_unlock(&kmem_lock);
+	return c;
+}
+
+//
+// Allocate an object from c, or return NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct KmemCache *c)
+{
+	struct KmemMagazine *m = &c->kc_mags[cpunum()];
+
+	if (m->km_count == 0)
+		kmem_mag_refill(c, m);
+	else
+		m->km_hits++;
+	if (m->km_count == 0)
+		return NULL;
+	m->km_allocs++;
+	return m->km_objs[--m->km_count];
+}
+
+//
+// Return an object from kmem_cache_alloc(c) to c.
+//
+void
+kmem_cache_free(struct KmemCache *c, void *obj)
+{
+	struct KmemMagazine *m = &c->kc_mags[cpunum()];
+
+	assert(kmem_slab_of(obj)->ks_cache == c);
+	if (m->km_count >= KMEM_MAG_MAX)
+		kmem_mag_drain(c, m);
+	else
+		m->km_hits++;
+	m->km_frees++;
+	m->km_objs[m->km_count++] = obj;
+}
+
+//
+// Allocate 'size' bytes of kernel memory, aligned to 16 bytes.
+// Returns NULL if size is 0 or there is not enough memory.
+//
+void *
+kmalloc(size_t size)
+{
+	struct PageInfo *pp;
+	struct KmemSlab *s;
+	int i, order;
+
+	if (size == 0)
+		return NULL;
+	if (size <= KMEM_MAX_SIZE) {
+		for (i = 0; (KMALLOC_MIN << i) < size; i++)
+			/* do nothing */;
+		return kmem_cache_alloc(kmalloc_caches[i]);
+	}
+
+	for (order = 0; (PGSIZE << order) < KMEM_HDRSIZE + size; order++)
+		if (order == PAGE_MAX_ORDER)
+			return NULL;
+	if (!(pp = page_alloc_order(order, 0)))
+		return NULL;
+	s = (struct KmemSlab *) page2kva(pp);
+	memset(s, 0, sizeof(struct KmemSlab));
+	s->ks_order = order;
+	return (char *) s + KMEM_HDRSIZE;
+}
+
+//
+// Free memory returned by kmalloc.  kfree(NULL) does nothing.
+//
+void
+kfree(void *p)
+{
+	struct KmemSlab *s;
+
+	if (!p)
+		return;
+	s = kmem_slab_of(p);
+	if (s->ks_cache)
+		kmem_cache_free(s->ks_cache, p);
+	else
+		page_free_order(pa2page(PADDR(s)), s->ks_order);
+}
+
+void
+kmem_init(void)
+{
+	int i;
+
+	__spin_initlock(&kmem_lock, "kmem_lock");
+	for (i = 0; i < KMALLOC_NCACHES; i++)
+		if (!(kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i],
+							    KMALLOC_MIN << i, NULL)))
+			panic("kmem_init: out of memory");
+	static_assert((KMALLOC_MIN << (KMALLOC_NCACHES - 1)) == KMEM_MAX_SIZE);
+
+	check_kmalloc();
+}
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static int check_ctor_calls;
+
+static void
+check_ctor(void *obj)
+{
+	*(uint32_t *) obj = 0xC0FFEE;
+	check_ctor_calls++;
+}
+
+static void
+check_kmalloc(void)
+{
+	static void *objs[200];
+	struct KmemCache *c;
+	size_t sizes[] = { 1, 16, 17, 100, 1024, 1025, 5000, 3 * PGSIZE };
+	int i, j, n;
+	char *p;
+
+	// Objects of every size are distinct, aligned and hold their data
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		for (j = 0; j < 8; j++) {
+			p = objs[j] = kmalloc(sizes[i]);
+			assert(p && (uintptr_t) p % 16 == 0);
+			memset(p, j, sizes[i]);
+		}
+		for (j = 0; j < 8; j++) {
+			p = objs[j];
+			assert(p[0] == j && p[sizes[i] - 1] == j);
+			kfree(p);
+		}
+	}
+	assert(kmalloc(0) == NULL);
+	kfree(NULL);
+
+	// Enough objects to fill several slabs and magazines
+	for (i = 0; i < ARRAY_SIZE(objs); i++) {
+		assert((objs[i] = kmalloc(64)));
+		*(int *) objs[i] = i;
+	}
+	for (i = 0; i < ARRAY_SIZE(objs); i++) {
+		assert(*(int *) objs[i] == i);
+		kfree(objs[i]);
+	}
+
+	// Constructed objects keep their state across free and alloc
+	c = kmem_cache_create("check_kmalloc", 40, check_ctor);
+	assert(c && c->kc_stride >= 44);
+	for (i = 0; i < ARRAY_SIZE(objs); i++) {
+		assert((objs[i] = kmem_cache_alloc(c)));
+		assert(*(uint32_t *) objs[i] == 0xC0FFEE);
+	}
+	n = check_ctor_calls;
+	assert(n >= ARRAY_SIZE(objs));
+	for (i = 0; i < ARRAY_SIZE(objs); i++)
+		kmem_cache_free(c, objs[i]);
+	for (i = 0; i < 10; i++) {
+		assert((objs[i] = kmem_cache_alloc(c)));
+		assert(*(uint32_t *) objs[i] == 0xC0FFEE);
+	}
+	for (i = 0; i < 10; i++)
+		kmem_cache_free(c, objs[i]);
+	assert(check_ctor_calls == n);
+
+	cprintf("check_kmalloc() succeeded!\n");
+}
@@ -0,0 +1,54 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Largest object a KmemCache holds.  kmalloc serves bigger requests
+// straight from page_alloc_order.
+#define KMEM_MAX_SIZE	1024
+
+// Per-CPU cache of free objects, see kmem_cache_alloc()
+#define KMEM_MAG_BATCH	8
+#define KMEM_MAG_MAX	(2 * KMEM_MAG_BATCH)
+
+struct KmemMagazine {
+	void *km_objs[KMEM_MAG_MAX];	// Free objects
+	int km_count;			// Number of entries in km_objs
+	uint32_t km_allocs;		// Objects allocated on this CPU
+	uint32_t km_frees;		// Objects freed on this CPU
+	uint32_t km_hits;		// Allocs and frees served locally
+} __attribute__((aligned(64)));		// One cache line per CPU
+
+// A cache of equally sized objects, carved out of one-page slabs.
+struct KmemCache {
+	const char *kc_name;
+	size_t kc_size;			// Object size as requested
+	size_t kc_stride;		// Distance between objects in a slab
+	size_t kc_linkoff;		// Where a free object keeps its link
+	int kc_perslab;			// Objects per slab
+	void (*kc_ctor)(void *);	// Run once on every new object
+	struct KmemSlab *kc_partial;	// Slabs with free objects
+	int kc_nslabs;			// Slabs allocated
+	struct spinlock kc_lock;	// Protects kc_partial and the slabs
+	struct KmemCache *kc_next;	// Next on kmem_caches
+	struct KmemMagazine kc_mags[NCPU];
+};
+
+extern struct KmemCache *kmem_caches;	// All caches, linked by kc_next
+
+void	kmem_init(void);
+struct KmemCache *kmem_cache_create(const char *name, size_t size,
+				    void (*ctor)(void *));
+void	*kmem_cache_alloc(struct KmemCache *c);
+void	kmem_cache_free(struct KmemCache *c, void *obj);
+void	*kmalloc(size_t size);
+void	kfree(void *p);
+
+#endif // !JOS_KERN_KMALLOC_H
@@ -65,13 +65,12 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  It stays off until the scheduler
+	// programs it with lapic_timer for the next event it cares about.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000);
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, 0);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -111,14 +110,32 @@ lapic_init(void)
 	lapicw(TPR, 0);
 }
 
+// Return this CPU's LAPIC ID, which is also its index in cpus[].
+// Before lapic_init runs, this is the boot CPU, so return 0.
 int
-cpunum(void)
+lapic_id(void)
 {
 	if (lapic)
 		return lapic[ID] >> 24;
 	return 0;
 }
 
+// Make the timer interrupt this CPU once, 'count' bus cycles from now,
+// or not at all if count is 0.  Replaces any earlier setting.
+void
+lapic_timer(uint32_t count)
+{
+	if (lapic)
+		lapicw(TICR, count);
+}
+
+// Return what is left of the count lapic_timer started.
+uint32_t
+lapic_timer_count(void)
+{
+	return lapic ? lapic[TCCR] : 0;
+}
+
 // Acknowledge interrupt.
 void
 lapic_eoi(void)
@@ -180,3 +197,13 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send an interrupt to CPU cpu alone.
+void
+lapic_ipi_cpu(int cpu, int vector)
+{
+	lapicw(ICRHI, cpus[cpu].cpu_id << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
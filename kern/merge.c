@@ -0,0 +1,286 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/merge.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kmalloc.h>
+#include <kern/spinlock.h>
+
+// Same-page merging.  Idle CPUs sweep the user pages of all
+// environments, clock-style, a few at a time (see sched_halt).  Every
+// private page is hashed; a page whose hash matches a page in the
+// stable table and whose contents are byte-identical is replaced by a
+// copy-on-write mapping of the stable page, and freed.  page_cow_fault
+// splits the mapping again on the first write.
+//
+// Pages enter the stable table only after their hash is seen unchanged
+// on two sweeps, so pages that are being written do not go read-only
+// (and take a copy-on-write fault) every time they are scanned.  The
+// table holds a reference on each of its pages, which keeps the pages
+// copy-on-write in every mapping, so their contents cannot change.  A
+// stable page that nobody maps any more is dropped.
+
+#define MERGE_SCAN_MAX	NPTENTRIES	// PTEs examined per merge_scan
+#define MERGE_NBUCKETS	1024		// Buckets in each table
+
+struct MergeNode {
+	uint32_t mn_hash;		// Hash of the page's contents
+	uint32_t mn_sweep;		// Sweep that last saw the page
+	struct PageInfo *mn_page;
+	struct MergeNode *mn_next;	// Next in the bucket
+};
+
+struct MergeStats merge_stats;
+
+static struct KmemCache *merge_node_cache;
+// Pages known to be stable, hashed by contents.  Each holds a reference.
+static struct MergeNode *merge_stable[MERGE_NBUCKETS];
+// Candidates from recent sweeps, hashed by page number, no references.
+static struct MergeNode *merge_unstable[MERGE_NBUCKETS];
+// Whether the current and the last complete sweep found anything to
+// track or merge, see merge_scan.
+static bool merge_progress, merge_busy = true;
+static int merge_hand_env;		// Where merge_scan resumes its sweep
+static uintptr_t merge_hand_va;
+static struct spinlock merge_lock;	// Protects all of the above
+
+void
+merge_init(void)
+{
+	__spin_initlock(&merge_lock, "merge_lock");
+	if (!(merge_node_cache = kmem_cache_create("merge_node",
+						   sizeof(struct MergeNode),
+						   NULL)))
+		panic("merge_init: out of memory");
+}
+
+// FNV-1a over the words of page pp
+static uint32_t
+merge_hash(struct PageInfo *pp)
+{
+	const uint32_t *w = kmap(pp);
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < PGSIZE / 4; i++)
+		h = (h ^ w[i]) * 16777619;
+	kunmap((void *) w);
+	return h;
+}
+
+// Return true if pages pp1 and pp2 hold the same bytes.
+static bool
+merge_same(struct PageInfo *pp1, struct PageInfo *pp2)
+{
+	void *va1 = kmap(pp1), *va2 = kmap(pp2);
+	bool same = memcmp(va1, va2, PGSIZE) == 0;
+
+	kunmap(va2);
+	kunmap(va1);
+	return same;
+}
+
+// Make the page at va in e, which must be locked, copy-on-write, so
+// that its contents stay put from here on.  A write now faults and
+// waits for e's lock in page_cow_fault, which simply makes the page
+// writable again if it has not been merged by then.
+static void
+merge_protect(struct Env *e, uintptr_t va, pte_t *pte)
+{
+	if (*pte & PTE_W) {
+		*pte = (*pte & ~PTE_W) | PTE_COW;
+		tlb_invalidate(e->env_pgdir, (void *) va);
+	}
+}
+
+// Drop the stable pages nobody but the table refers to, and the
+// candidates the sweep that just ended did not see.
+static void
+merge_prune(void)
+{
+	struct MergeNode **pmn, *mn;
+	int i;
+
+	for (i = 0; i < MERGE_NBUCKETS; i++) {
+		for (pmn = &merge_stable[i]; (mn = *pmn); ) {
+			if (mn->mn_page->pp_ref == 1) {
+				*pmn = mn->mn_next;
+				page_decref(mn->mn_page);
+				kmem_cache_free(merge_node_cache, mn);
+				merge_stats.ms_stable--;
+			} else
+				pmn = &mn->mn_next;
+		}
+		for (pmn = &merge_unstable[i]; (mn = *pmn); ) {
+			if (mn->mn_sweep != merge_stats.ms_sweeps) {
+				*pmn = mn->mn_next;
+				kmem_cache_free(merge_node_cache, mn);
+			} else
+				pmn = &mn->mn_next;
+		}
+	}
+}
+
+// Try to merge the page pp mapped at va in e, which must be locked,
+// with a stable page, or else to make it stable.  Called with
+// merge_lock held.  Returns true if pp was merged away.
+static bool
+merge_page(struct Env *e, uintptr_t va, pte_t *pte, struct PageInfo *pp)
+{
+	struct MergeNode **pmn, *mn;
+	uint32_t h = merge_hash(pp);
+
+	merge_stats.ms_scanned++;
+	for (mn = merge_stable[h % MERGE_NBUCKETS]; mn; mn = mn->mn_next) {
+		if (mn->mn_hash != h || mn->mn_page == pp)
+			continue;
+		merge_protect(e, va, pte);
+		if (!merge_same(mn->mn_page, pp))
+			continue;
+		page_incref(mn->mn_page);
+		*pte = page2pa(mn->mn_page) | (*pte & PTE_SYSCALL);
+		tlb_invalidate(e->env_pgdir, (void *) va);
+		page_decref(pp);
+		merge_stats.ms_merges++;
+		merge_progress = true;
+		return true;
+	}
+
+	for (pmn = &merge_unstable[PGNUM(page2pa(pp)) % MERGE_NBUCKETS];
+	     (mn = *pmn) && mn->mn_page != pp; pmn = &mn->mn_next)
+		/* do nothing */;
+	if (!mn) {
+		if (!(mn = kmem_cache_alloc(merge_node_cache)))
+			return false;
+		mn->mn_hash = h;
+		mn->mn_page = pp;
+		mn->mn_next = merge_unstable[PGNUM(page2pa(pp)) % MERGE_NBUCKETS];
+		merge_unstable[PGNUM(page2pa(pp)) % MERGE_NBUCKETS] = mn;
+		merge_progress = true;
+	} else if (mn->mn_hash == h && mn->mn_sweep != merge_stats.ms_sweeps) {
+		// Unchanged since an earlier sweep.  Rehash once it can
+		// no longer change, then move it to the stable table.
+		merge_protect(e, va, pte);
+		if (merge_hash(pp) == h) {
+			*pmn = mn->mn_next;
+			page_incref(pp);
+			mn->mn_next = merge_stable[h % MERGE_NBUCKETS];
+			merge_stable[h % MERGE_NBUCKETS] = mn;
+			merge_stats.ms_stable++;
+			merge_progress = true;
+			return false;
+		}
+	}
+	if (mn->mn_hash != h)
+		merge_progress = true;
+	mn->mn_hash = h;
+	mn->mn_sweep = merge_stats.ms_sweeps;
+	return false;
+}
+
+// Scan e, which must be locked, from *va up, advancing *va and using
+// up *budget PTEs.
+static void
+merge_scan_env(struct Env *e, uintptr_t *va, int *budget)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	for (; *va < UTOP && *budget > 0; *va += PGSIZE) {
+		if (!(e->env_pgdir[PDX(*va)] & PTE_P)) {
+			// Skip to the next page table
+			*va = ROUNDDOWN(*va, PTSIZE) + PTSIZE - PGSIZE;
+			continue;
+		}
+		(*budget)--;
+		pte = (pte_t *) KADDR(PTE_ADDR(e->env_pgdir[PDX(*va)])) + PTX(*va);
+		if ((*pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U) || (*pte & PTE_SHARE))
+			continue;
+		// Pages mapped more than once are shared already, or
+		// are someone's copy-on-write page after a fork.
+		pp = pa2page(PTE_ADDR(*pte));
+		if (pp->pp_ref != 1)
+			continue;
+		spin_lock(&merge_lock);
+		merge_page(e, *va, pte, pp);
+		spin_unlock(&merge_lock);
+	}
+}
+
+//
+// Run one step of the merging sweep: examine up to MERGE_SCAN_MAX
+// PTEs, resuming where the last step left off.  Environments that are
+// dying or not yet started are skipped, as are those whose lock
+// someone else holds.
+//
+// Returns true unless the last complete sweep and this one so far
+// found no new candidates, promotions or merges.  Once that happens
+// the memory of the environments is not changing, and idle CPUs need
+// not wake up just to scan it again.
+//
+bool
+merge_scan(void)
+{
+	struct Env *e;
+	uintptr_t va;
+	int i, idx, budget = MERGE_SCAN_MAX;
+	bool busy;
+
+	spin_lock(&merge_lock);
+	idx = merge_hand_env;
+	va = merge_hand_va;
+	spin_unlock(&merge_lock);
+
+	for (i = 0; i <= NENV && budget > 0; i++) {
+		e = &envs[idx];
+		if (env_trylock(e)) {
+			if ((e->env_status == ENV_RUNNABLE
+			     || e->env_status == ENV_RUNNING
+			     || e->env_status == ENV_NOT_RUNNABLE)
+			    && e->env_runs > 0)
+				merge_scan_env(e, &va, &budget);
+			else
+				va = UTOP;
+			env_unlock(e);
+		} else
+			va = UTOP;
+		if (va < UTOP)
+			break;
+		idx = (idx + 1) % NENV;
+		va = 0;
+		if (idx == 0) {
+			spin_lock(&merge_lock);
+			merge_prune();
+			merge_stats.ms_sweeps++;
+			merge_busy = merge_progress;
+			merge_progress = false;
+			spin_unlock(&merge_lock);
+		}
+	}
+
+	spin_lock(&merge_lock);
+	merge_hand_env = idx;
+	merge_hand_va = va;
+	busy = budget < MERGE_SCAN_MAX && (merge_busy || merge_progress);
+	spin_unlock(&merge_lock);
+	return busy;
+}
+
+// Return the number of pages merging saves right now: a stable page
+// mapped n times stands for n pages, and costs one.
+int
+merge_saved(void)
+{
+	struct MergeNode *mn;
+	int i, saved = 0;
+
+	spin_lock(&merge_lock);
+	for (i = 0; i < MERGE_NBUCKETS; i++)
+		for (mn = merge_stable[i]; mn; mn = mn->mn_next)
+			saved += mn->mn_page->pp_ref - 2;
+	spin_unlock(&merge_lock);
+	return saved;
+}
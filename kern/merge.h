@@ -0,0 +1,25 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_MERGE_H
+#define JOS_KERN_MERGE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Counters for same-page merging, see merge_scan()
+struct MergeStats {
+	uint32_t ms_sweeps;		// Passes over all environments
+	uint32_t ms_scanned;		// Candidate pages hashed
+	uint32_t ms_stable;		// Pages in the stable table
+	uint32_t ms_merges;		// Mappings redirected to a stable page
+};
+
+extern struct MergeStats merge_stats;
+
+void	merge_init(void);
+bool	merge_scan(void);
+int	merge_saved(void);
+
+#endif // !JOS_KERN_MERGE_H
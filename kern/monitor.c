@@ -11,6 +11,12 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/swap.h>
+#include <kern/merge.h>
+#include <kern/sched.h>
+#include <kern/kclock.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -27,7 +33,13 @@ static struct Command commands[] = {
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
     { "backtrace", "Backtrace", mon_backtrace },
     { "continue", "Continue instructions", mon_continue },
-    { "stepi", "Single-step one instruction", mon_stepi }
+    { "stepi", "Single-step one instruction", mon_stepi },
+    { "pagemags", "Display per-CPU page magazine counters", mon_pagemags },
+    { "zeropool", "Display pre-zeroed page pool counters", mon_zeropool },
+    { "kmem", "Display kernel object cache usage", mon_kmem },
+    { "swap", "Display swap usage and paging counters", mon_swap },
+    { "merge", "Display same-page merging counters", mon_merge },
+    { "quantum", "Display or set the time slice in microseconds", mon_quantum }
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -134,6 +146,100 @@ mon_stepi(int argc, char **argv, struct Trapframe *tf) {
     return -1;
 }
 
+int
+mon_pagemags(int argc, char **argv, struct Trapframe *tf)
+{
+	int i;
+	uint32_t hits = 0, refills = 0, drains = 0;
+
+	cprintf("CPU  cached      hits   refills    drains\n");
+	for (i = 0; i < ncpu; i++) {
+		struct PageMagazine *mag = &page_mags[i];
+		cprintf("%3d %7d %9u %9u %9u\n", i, mag->pm_count,
+			mag->pm_hits, mag->pm_refills, mag->pm_drains);
+		hits += mag->pm_hits;
+		refills += mag->pm_refills;
+		drains += mag->pm_drains;
+	}
+	cprintf("total       %9u %9u %9u\n", hits, refills, drains);
+	return 0;
+}
+
+int
+mon_zeropool(int argc, char **argv, struct Trapframe *tf)
+{
+	struct PageZeroStats *zs = &page_zero_stats;
+	uint32_t total = zs->pz_hits + zs->pz_misses;
+
+	cprintf("pooled %d, %d high, filled %u\n", zs->pz_count,
+		zs->pz_high_count, zs->pz_fills);
+	cprintf("ALLOC_ZERO: %u hits, %u misses, %u%% hit rate\n",
+		zs->pz_hits, zs->pz_misses,
+		total ? zs->pz_hits * 100 / total : 0);
+	return 0;
+}
+
+int
+mon_kmem(int argc, char **argv, struct Trapframe *tf)
+{
+	struct KmemCache *c;
+	int i, cached;
+	uint32_t allocs, frees, hits;
+
+	cprintf("cache          size slabs  inuse cached    allocs  hit%%\n");
+	for (c = kmem_caches; c; c = c->kc_next) {
+		cached = allocs = frees = hits = 0;
+		for (i = 0; i < ncpu; i++) {
+			cached += c->kc_mags[i].km_count;
+			allocs += c->kc_mags[i].km_allocs;
+			frees += c->kc_mags[i].km_frees;
+			hits += c->kc_mags[i].km_hits;
+		}
+		cprintf("%-14s %4d %5d %6d %6d %9u %4u%%\n", c->kc_name,
+			c->kc_size, c->kc_nslabs, allocs - frees, cached,
+			allocs, allocs + frees ? hits * 100 / (allocs + frees) : 0);
+	}
+	return 0;
+}
+
+int
+mon_swap(int argc, char **argv, struct Trapframe *tf)
+{
+	struct SwapStats *ss = &swap_stats;
+
+	if (ss->sw_nslots == 0) {
+		cprintf("no swap disk\n");
+		return 0;
+	}
+	cprintf("%u of %u slots used, %u pages out, %u pages in\n",
+		ss->sw_used, ss->sw_nslots, ss->sw_outs, ss->sw_ins);
+	return 0;
+}
+
+int
+mon_merge(int argc, char **argv, struct Trapframe *tf)
+{
+	struct MergeStats *ms = &merge_stats;
+
+	cprintf("%u sweeps, %u pages scanned, %u merges\n",
+		ms->ms_sweeps, ms->ms_scanned, ms->ms_merges);
+	cprintf("%u stable pages, %d pages saved\n",
+		ms->ms_stable, merge_saved());
+	return 0;
+}
+
+int
+mon_quantum(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1 && sched_set_quantum(strtol(argv[1], NULL, 0)) < 0)
+		cprintf("quantum must be %u to %u us\n",
+			SCHED_QUANTUM_MIN_US, SCHED_QUANTUM_MAX_US);
+	cprintf("time slice %u us; TSC %u kHz, LAPIC timer %u kHz\n",
+		sched_quantum_us, (uint32_t) (kclock_tsc_hz / 1000),
+		kclock_lapic_hz / 1000);
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
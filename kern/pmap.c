@@ -10,15 +10,85 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/swap.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
+size_t npages_lowmem;		// Pages mapped at KERNBASE
 static size_t npages_basemem;	// Amount of base memory (in pages)
+static struct E820Entry *e820_map;	// The BIOS's memory map, if any
+static uint32_t e820_nmap;
 
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+// Buddy allocator: page_free_area[o] lists the free blocks of 2^o
+// physically contiguous, 2^o-aligned pages, linked through the head
+// page's pp_link and pp_prev.
+static struct PageInfo *page_free_area[PAGE_MAX_ORDER + 1];
+// Free pages beyond npages_lowmem, linked through pp_link.  Only
+// page_alloc(ALLOC_HIGHMEM) hands them out.
+static struct PageInfo *page_high_free;
+static size_t page_high_nfree;
+static struct spinlock page_lock;	// Protects all of the above
+
+// Per-CPU magazines of free pages in front of the buddy allocator.
+// A CPU allocates from and frees to its own magazine without locking
+// (interrupts are off in the kernel, so nothing else touches it), and
+// moves pages to or from the buddy allocator PAGE_MAG_BATCH at a time.
+#define PAGE_MAG_BATCH	16
+#define PAGE_MAG_MAX	(2 * PAGE_MAG_BATCH)
+
+struct PageMagazine page_mags[NCPU];
+static bool page_mags_enabled;		// Set once mem_init's checks are done
+
+// Pages that idle CPUs have already cleared, so page_alloc(ALLOC_ZERO)
+// can skip the memset.  Linked through pp_link.  High memory pages go
+// in a pool of their own, for ALLOC_HIGHMEM callers only.
+#define PAGE_ZERO_POOL_MAX	128
+
+static struct PageInfo *page_zero_pool;
+static struct PageInfo *page_zero_high_pool;
+static struct spinlock page_zero_lock;	// Protects both pools
+struct PageZeroStats page_zero_stats;
+
+// Set if the processor supports 4MB pages, which boot_map_region
+// then uses wherever it can.
+static bool pmap_pse;
+
+// TLB shootdown.  A CPU that changes a mapping other CPUs may cache
+// fills in their TlbRequest slots, sends each an IRQ_TLBFLUSH IPI and
+// waits for tr_pending to clear.  cpus[i].cpu_pgdir (see pgdir_load)
+// says which CPUs can cache a user mapping.
+#define TLB_FLUSH_MAX	32	// Pages invlpg'd before reloading %cr3
+#define TLB_BATCH_MAX	64	// Pages a TlbBatch holds before flushing
+
+struct TlbRequest {
+	volatile uint32_t tr_lock;	// Held by the CPU filling the slot
+	volatile uint32_t tr_pending;	// Set until the target has flushed
+	pde_t *tr_pgdir;
+	uintptr_t tr_start, tr_end;
+} __attribute__((aligned(64)));
+
+static struct TlbRequest tlb_requests[NCPU];	// Indexed by target CPU
+
+// Per-CPU batch of pending invalidations, see tlb_batch_begin()
+struct TlbBatch {
+	int tb_depth;			// Nesting of tlb_batch_begin
+	pde_t *tb_pgdir;
+	uintptr_t tb_start, tb_end;	// Range to invalidate
+	struct PageInfo *tb_free;	// Pages to free afterwards
+	int tb_nfree;
+} __attribute__((aligned(64)));
+
+static struct TlbBatch tlb_batches[NCPU];
+static bool tlb_batch_hold(pde_t *pgdir, struct PageInfo *pp);
+
+// Page table for the kmap slots; slot i of CPU c is at
+// KMAPBASE + (c * KMAPSLOTS + i) * PGSIZE.
+static pte_t *kmap_ptes;
+static int kmap_depth[NCPU];		// Slots in use on each CPU
 
 
 // --------------------------------------------------------------
@@ -31,10 +101,28 @@ nvram_read(int r)
 	return mc146818_read(r) | (mc146818_read(r + 1) << 8);
 }
 
+// Return true if the page at pa is usable memory according to the
+// BIOS's E820 map.  Without a map, everything below npages is.
+static bool
+e820_ram(physaddr_t pa)
+{
+	uint32_t i;
+
+	if (!e820_map)
+		return 1;
+	for (i = 0; i < e820_nmap; i++)
+		if (e820_map[i].ee_type == E820_RAM && e820_map[i].ee_addr <= pa
+		    && pa + PGSIZE <= e820_map[i].ee_addr + e820_map[i].ee_len)
+			return 1;
+	return 0;
+}
+
 static void
 i386_detect_memory(void)
 {
 	size_t basemem, extmem, ext16mem, totalmem;
+	uint64_t end, top = 0;
+	uint32_t i, n;
 
 	// Use CMOS calls to measure available base & extended memory.
 	// (CMOS calls return results in kilobytes.)
@@ -51,11 +139,32 @@ i386_detect_memory(void)
 	else
 		totalmem = basemem;
 
+	// The CMOS cannot describe more than 4GB, nor the holes in it, so
+	// prefer the map the boot loader got from the BIOS.  Physical
+	// addresses are 32 bits, so memory above 4GB is out of reach.
+	n = *(uint32_t *) (KERNBASE + E820_MAP);
+	if (n > 0 && n <= E820_MAX) {
+		e820_map = (struct E820Entry *) (KERNBASE + E820_MAP + 4);
+		e820_nmap = n;
+		for (i = 0; i < n; i++) {
+			if (e820_map[i].ee_type != E820_RAM)
+				continue;
+			end = MIN(e820_map[i].ee_addr + e820_map[i].ee_len,
+				  0x100000000ULL);
+			if (e820_map[i].ee_addr == 0)
+				basemem = end / 1024;
+			top = MAX(top, end);
+		}
+		totalmem = top / 1024;
+	}
+
 	npages = totalmem / (PGSIZE / 1024);
 	npages_basemem = basemem / (PGSIZE / 1024);
+	npages_lowmem = MIN(npages, PGNUM(0xFFFFFFFF - KERNBASE) + 1);
 
-	cprintf("Physical memory: %uK available, base = %uK, extended = %uK\n",
-		totalmem, basemem, totalmem - basemem);
+	cprintf("Physical memory: %uK available, base = %uK, extended = %uK, high = %uK\n",
+		totalmem, basemem, npages_lowmem * (PGSIZE / 1024) - basemem,
+		(npages - npages_lowmem) * (PGSIZE / 1024));
 }
 
 
@@ -66,11 +175,13 @@ i386_detect_memory(void)
 static void mem_init_mp(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
+static void page_init_high(void);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void check_page_alloc_order(void);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -83,7 +194,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the page free lists have been set up.
 // Note that when this function is called, we are still using entry_pgdir,
 // which only maps the first 4MB of physical memory.
 static void *
@@ -133,7 +244,7 @@ boot_alloc(uint32_t n)
 void
 mem_init(void)
 {
-	uint32_t cr0;
+	uint32_t cr0, edx;
 	size_t n;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
@@ -156,6 +267,17 @@ mem_init(void)
 	// Permissions: kernel R, user R
 	kern_pgdir[PDX(UVPT)] = PADDR(kern_pgdir) | PTE_U | PTE_P;
 
+	// entry_pgdir maps only the low 4MB, where 'pages' and 'envs'
+	// must fit for now, as must 'pages' at UPAGES later.
+	n = (PTSIZE - PADDR(boot_alloc(0))
+	     - ROUNDUP(NENV * sizeof(struct Env), PGSIZE)) / sizeof(struct PageInfo);
+	if (npages > n) {
+		cprintf("Physical memory: using only the first %uK\n",
+			n * (PGSIZE / 1024));
+		npages = n;
+		npages_lowmem = MIN(npages_lowmem, npages);
+	}
+
 	//////////////////////////////////////////////////////////////////////
 	// Allocate an array of npages 'struct PageInfo's and store it in 'pages'.
 	// The kernel uses this array to keep track of physical pages: for
@@ -181,10 +303,13 @@ mem_init(void)
 
 	check_page_free_list(1);
 	check_page_alloc();
+	check_page_alloc_order();
 	check_page();
 
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory
+	cpuid(1, NULL, NULL, NULL, &edx);
+	pmap_pse = (edx & CPUID_FEAT_PSE) != 0;
 
 	//////////////////////////////////////////////////////////////////////
 	// Map 'pages' read-only by the user at linear address UPAGES
@@ -193,7 +318,7 @@ mem_init(void)
 	//      (ie. perm = PTE_U | PTE_P)
 	//    - pages itself -- kernel RW, user NONE
 	// Your code goes here:
-    boot_map_region(kern_pgdir, UPAGES, ROUNDUP(npages * sizeof(struct PageInfo), PGSIZE), PADDR(pages), PTE_U | PTE_P);
+    boot_map_region(kern_pgdir, UPAGES, ROUNDUP(npages * sizeof(struct PageInfo), PGSIZE), PADDR(pages), PTE_U | PTE_P | PTE_G);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map the 'envs' array read-only by the user at linear address UENVS
@@ -202,7 +327,7 @@ mem_init(void)
 	//    - the new image at UENVS  -- kernel R, user R
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
-	boot_map_region(kern_pgdir, UENVS, ROUNDUP(NENV * sizeof(struct Env), PGSIZE), PADDR(envs), PTE_U | PTE_P);
+	boot_map_region(kern_pgdir, UENVS, ROUNDUP(NENV * sizeof(struct Env), PGSIZE), PADDR(envs), PTE_U | PTE_P | PTE_G);
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -215,7 +340,7 @@ mem_init(void)
 	//       overwrite memory.  Known as a "guard page".
 	//     Permissions: kernel RW, user NONE
 	// Your code goes here:
-    boot_map_region(kern_pgdir, KSTACKTOP - KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W);
+    boot_map_region(kern_pgdir, KSTACKTOP - KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W | PTE_G);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
@@ -226,7 +351,11 @@ mem_init(void)
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
 	// 2^32 needs to be 0xffffffff
-	boot_map_region(kern_pgdir, KERNBASE, ROUNDUP(0xffffffff - KERNBASE, PGSIZE), 0, PTE_W);
+	//
+	// Everything mapped above UTOP is the same in every environment
+	// (env_setup_vm copies it), so mark it global: with CR4_PGE set,
+	// the lcr3 in env_run then flushes only the user TLB entries.
+	boot_map_region(kern_pgdir, KERNBASE, ROUNDUP(0xffffffff - KERNBASE, PGSIZE), 0, PTE_W | PTE_G);
 
 	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
@@ -241,8 +370,11 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
-	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();	// kern_pgdir may use 4MB pages
+	pgdir_load(kern_pgdir);
 
+	// Now all of physical memory is mapped at KERNBASE
+	page_init_high();
 	check_page_free_list(0);
 
 	// entry.S set the really important flags in cr0 (including enabling
@@ -254,6 +386,10 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	// The checks above count the pages on the free lists, so only
+	// start caching free pages per CPU now.
+	page_mags_enabled = 1;
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -280,8 +416,31 @@ mem_init_mp(void)
 	// LAB 4: Your code here:
 	for (int i = 0; i < NCPU; i++) {
         uintptr_t kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
-        boot_map_region(kern_pgdir, kstacktop_i - KSTKSIZE, KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W);
+        boot_map_region(kern_pgdir, kstacktop_i - KSTKSIZE, KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W | PTE_G);
     }
+
+	// The kmap slots sit below the stacks, in the same page table.
+	// Every environment shares that page table with kern_pgdir.
+	static_assert(KMAPBASE + KMAPSIZE
+		      <= KSTACKTOP - NCPU * (KSTKSIZE + KSTKGAP));
+	kmap_ptes = pgdir_walk(kern_pgdir, (void *) KMAPBASE, 1);
+	assert(kmap_ptes);
+	kmap_ptes -= PTX(KMAPBASE);
+}
+
+// Paging setup that each CPU does for itself before loading kern_pgdir:
+// enable the 4MB pages and global pages that mem_init created, if the
+// processor supports them.
+void
+mem_init_percpu(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_FEAT_PSE)
+		lcr4(rcr4() | CR4_PSE);
+	if (edx & CPUID_FEAT_PGE)
+		lcr4(rcr4() | CR4_PGE);
 }
 
 // --------------------------------------------------------------
@@ -290,11 +449,81 @@ mem_init_mp(void)
 // Pages are reference counted, and free pages are kept on a linked list.
 // --------------------------------------------------------------
 
+// Put the block of 2^order pages at pp on its free list.
+static void
+buddy_insert(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_free = 1;
+	pp->pp_prev = NULL;
+	pp->pp_link = page_free_area[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	page_free_area[order] = pp;
+}
+
+// Take the block at pp off its free list.
+static void
+buddy_remove(struct PageInfo *pp)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_area[pp->pp_order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_free = 0;
+}
+
+// Allocate a block of 2^order pages, splitting a larger block if
+// there is no free block of that size.  The caller holds page_lock.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int o;
+
+	for (o = order; o <= PAGE_MAX_ORDER && !page_free_area[o]; o++)
+		/* do nothing */;
+	if (o > PAGE_MAX_ORDER)
+		return NULL;
+
+	pp = page_free_area[o];
+	buddy_remove(pp);
+	// Return the upper halves to the free lists
+	while (o > order) {
+		o--;
+		buddy_insert(pp + (1 << o), o);
+	}
+	return pp;
+}
+
+// Free the block of 2^order pages at pp, merging it with its buddy
+// for as long as the buddy is free too.  The caller holds page_lock.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t i = pp - pages, buddy;
+
+	assert(!pp->pp_free && i % (1 << order) == 0);
+	while (order < PAGE_MAX_ORDER) {
+		buddy = i ^ (1 << order);
+		if (buddy + (1 << order) > npages_lowmem ||
+		    !pages[buddy].pp_free || pages[buddy].pp_order != order)
+			break;
+		buddy_remove(&pages[buddy]);
+		i &= ~(1 << order);
+		order++;
+	}
+	buddy_insert(&pages[i], order);
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy allocator's free lists.
 //
 void
 page_init(void)
@@ -330,6 +559,10 @@ page_init(void)
 
     extern unsigned char mpentry_start[], mpentry_end[];
     size_t i;
+
+    __spin_initlock(&page_lock, "page_lock");
+    __spin_initlock(&page_zero_lock, "page_zero_lock");
+    memset(page_free_area, 0, sizeof(page_free_area));
     for (i = 1; i < npages; i++) {
         if (i == 0) {
             pages[i].pp_ref = 1;
@@ -339,17 +572,184 @@ page_init(void)
             pages[i].pp_ref = 1;
         } else if (i >= MPENTRY_PADDR / PGSIZE && i <= (MPENTRY_PADDR + ROUNDUP(mpentry_end - mpentry_start, PGSIZE)) / PGSIZE) {
             pages[i].pp_ref = 1;
+        } else if (!e820_ram(i * PGSIZE)) {
+            // A hole, or memory the firmware keeps for itself
+            pages[i].pp_ref = 1;
         } else {
             pages[i].pp_ref = 0;
-            pages[i].pp_link = page_free_list;
-            page_free_list = &pages[i];
+            // Until mem_init loads kern_pgdir, only the low 4MB of
+            // physical memory is mapped, so only hand out pages from
+            // there.  page_init_high frees the rest.
+            if (i < PGNUM(PTSIZE))
+                buddy_free(&pages[i], 0);
         }
     }
 }
 
+//
+// Free the pages above 4MB that page_init held back.
+// Called once kern_pgdir maps all of the memory below npages_lowmem;
+// the pages above that go on page_high_free.
+//
+static void
+page_init_high(void)
+{
+	size_t i;
+
+	// page_init gave every page it did not free a nonzero pp_ref
+	for (i = PGNUM(PTSIZE); i < npages; i++) {
+		if (pages[i].pp_ref != 0)
+			continue;
+		if (i < npages_lowmem) {
+			buddy_free(&pages[i], 0);
+		} else {
+			pages[i].pp_link = page_high_free;
+			page_high_free = &pages[i];
+			page_high_nfree++;
+		}
+	}
+}
+
+// Take a page from page_high_free, or return NULL if there is none.
+static struct PageInfo *
+page_high_alloc(void)
+{
+	struct PageInfo *pp;
+
+	// Not worth taking the lock just to find nothing there
+	if (!page_high_free)
+		return NULL;
+
+	spin_lock(&page_lock);
+	if ((pp = page_high_free)) {
+		page_high_free = pp->pp_link;
+		page_high_nfree--;
+		pp->pp_link = NULL;
+	}
+	spin_unlock(&page_lock);
+	return pp;
+}
+
+// Move up to PAGE_MAG_BATCH pages from the buddy allocator to mag.
+static void
+page_mag_refill(struct PageMagazine *mag)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	while (mag->pm_count < PAGE_MAG_BATCH && (pp = buddy_alloc(0))) {
+		pp->pp_link = mag->pm_free;
+		mag->pm_free = pp;
+		mag->pm_count++;
+	}
+	spin_unlock(&page_lock);
+	mag->pm_refills++;
+}
+
+// Move PAGE_MAG_BATCH pages from mag back to the buddy allocator.
+static void
+page_mag_drain(struct PageMagazine *mag)
+{
+	struct PageInfo *pp;
+	int i;
+
+	spin_lock(&page_lock);
+	for (i = 0; i < PAGE_MAG_BATCH && (pp = mag->pm_free); i++) {
+		mag->pm_free = pp->pp_link;
+		mag->pm_count--;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
+	mag->pm_drains++;
+}
+
+// Take a page from the pool of zeroed pages, the high memory one if
+// 'high' is set, or return NULL if the pool is empty.  'zero' says
+// whether the caller asked for a zeroed page, which is what the hit
+// and miss counters track.
+static struct PageInfo *
+page_zero_take(bool high, bool zero)
+{
+	struct PageInfo **pool = high ? &page_zero_high_pool : &page_zero_pool;
+	int *count = high ? &page_zero_stats.pz_high_count
+			  : &page_zero_stats.pz_count;
+	struct PageInfo *pp;
+
+	// Not worth taking the lock just to find nothing there
+	if (!zero && !*count)
+		return NULL;
+
+	spin_lock(&page_zero_lock);
+	if ((pp = *pool)) {
+		*pool = pp->pp_link;
+		(*count)--;
+		pp->pp_link = NULL;
+	}
+	if (zero) {
+		if (pp)
+			page_zero_stats.pz_hits++;
+		else
+			page_zero_stats.pz_misses++;
+	}
+	spin_unlock(&page_zero_lock);
+	return pp;
+}
+
+// Add the zeroed page pp to the low or high memory pool.
+static void
+page_zero_put(bool high, struct PageInfo *pp)
+{
+	spin_lock(&page_zero_lock);
+	if (high) {
+		pp->pp_link = page_zero_high_pool;
+		page_zero_high_pool = pp;
+		page_zero_stats.pz_high_count++;
+	} else {
+		pp->pp_link = page_zero_pool;
+		page_zero_pool = pp;
+		page_zero_stats.pz_count++;
+	}
+	page_zero_stats.pz_fills++;
+	spin_unlock(&page_zero_lock);
+}
+
+//
+// Clear one free page and add it to a pool for page_alloc(ALLOC_ZERO).
+// Low memory comes first, then high memory through kmap.
+// Called by idle CPUs from sched_halt.
+//
+// Returns 0 if the pools are full or there is no free memory.
+//
+bool
+page_zero_fill(void)
+{
+	struct PageInfo *pp;
+	void *va;
+
+	// Take the page straight from the buddy allocator; page_alloc
+	// would hand back pool pages once memory runs low.
+	if (page_zero_stats.pz_count < PAGE_ZERO_POOL_MAX
+	    && (pp = page_alloc_order(0, ALLOC_ZERO))) {
+		page_zero_put(0, pp);
+		return 1;
+	}
+	if (page_zero_stats.pz_high_count < PAGE_ZERO_POOL_MAX
+	    && (pp = page_high_alloc())) {
+		va = kmap(pp);
+		memset(va, 0, PGSIZE);
+		kunmap(va);
+		page_zero_put(1, pp);
+		return 1;
+	}
+	return 0;
+}
+
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
-// returned physical page with '\0' bytes.  Does NOT increment the reference
+// returned physical page with '\0' bytes.  If (alloc_flags & ALLOC_HIGHMEM),
+// the page may come from beyond the memory mapped at KERNBASE, so the
+// caller must not use page2kva on it.  Does NOT increment the reference
 // count of the page - the caller must do these if necessary (either explicitly
 // or via page_insert).
 //
@@ -363,14 +763,104 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-	if (!page_free_list) return NULL;
-	struct PageInfo *pp = page_free_list;
-    page_free_list = pp->pp_link;
-    pp->pp_link = NULL;
+	struct PageInfo *pp;
+	void *va;
+
+	// Keep the memory the kernel can reach directly for those who
+	// need it, and high pages that idle CPUs cleared for those who
+	// want them zeroed
+	if (alloc_flags & ALLOC_HIGHMEM) {
+	    if ((alloc_flags & ALLOC_ZERO) && (pp = page_zero_take(1, 1)))
+	        return pp;
+	    if ((pp = page_high_alloc())) {
+	        if (alloc_flags & ALLOC_ZERO) {
+	            va = kmap(pp);
+	            memset(va, 0, PGSIZE);
+	            kunmap(va);
+	        }
+	        return pp;
+	    }
+	    // Out of high memory, but the cleared high pages are free too
+	    if ((pp = page_zero_take(1, 0)))
+	        return pp;
+	}
+
+	// Idle CPUs may have cleared a page for us already
+	if ((alloc_flags & ALLOC_ZERO) && (pp = page_zero_take(0, 1)))
+	    return pp;
+
+retry:
+	if (page_mags_enabled) {
+	    struct PageMagazine *mag = &page_mags[cpunum()];
+	    if (mag->pm_count == 0)
+	        page_mag_refill(mag);
+	    else
+	        mag->pm_hits++;
+	    // Out of memory: fall back on the zeroed pages, then on the
+	    // memory of environments that env_reap has not freed yet and
+	    // the page directories it keeps for reuse, and finally page
+	    // out user memory
+	    if (!(pp = mag->pm_free)) {
+	        if ((pp = page_zero_take(0, 0)))
+	            return pp;
+	        if (!env_reap() && !env_pgdir_drain()
+	            && !swap_out(PAGE_MAG_BATCH))
+	            return NULL;
+	        goto retry;
+	    }
+	    mag->pm_free = pp->pp_link;
+	    mag->pm_count--;
+	    pp->pp_link = NULL;
+	} else if (!(pp = page_alloc_order(0, 0))) {
+	    if (!env_reap() && !env_pgdir_drain()
+	        && !swap_out(PAGE_MAG_BATCH))
+	        return NULL;
+	    goto retry;
+	}
+
     if (alloc_flags & ALLOC_ZERO) memset(page2kva(pp), 0, PGSIZE);
 	return pp;
 }
 
+//
+// Allocates 2^order physically contiguous pages, aligned to their
+// size, and returns the PageInfo of the first one.  ALLOC_ZERO clears
+// the whole block.  As with page_alloc, reference counts are up to the
+// caller; only the first page's pp_ref is used for the block.
+//
+// Returns NULL if there is no free block large enough.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	assert(order >= 0 && order <= PAGE_MAX_ORDER);
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (!pp)
+		return NULL;
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Return a block from page_alloc_order(order) to the buddy allocator.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	if (pp->pp_ref != 0 || pp->pp_link)
+		panic("page_free_order: pp->pp_ref is nonzero or pp->pp_link is not NULL");
+
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -384,8 +874,37 @@ page_free(struct PageInfo *pp)
 	if (pp->pp_ref != 0 || pp->pp_link) {
 	    panic("pp->pp_ref is nonzero or pp->pp_link is not NULL");
 	}
-	pp->pp_link = page_free_list;
-    page_free_list = pp;
+
+	if (pp - pages >= npages_lowmem) {
+	    spin_lock(&page_lock);
+	    pp->pp_link = page_high_free;
+	    page_high_free = pp;
+	    page_high_nfree++;
+	    spin_unlock(&page_lock);
+	    return;
+	}
+
+	if (page_mags_enabled) {
+	    struct PageMagazine *mag = &page_mags[cpunum()];
+	    if (mag->pm_count >= PAGE_MAG_MAX)
+	        page_mag_drain(mag);
+	    else
+	        mag->pm_hits++;
+	    pp->pp_link = mag->pm_free;
+	    mag->pm_free = pp;
+	    mag->pm_count++;
+	} else {
+	    page_free_order(pp, 0);
+	}
+}
+
+//
+// Increment the reference count on a page.
+//
+void
+page_incref(struct PageInfo *pp)
+{
+	xaddw(&pp->pp_ref, 1);
 }
 
 //
@@ -395,10 +914,48 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	if (xaddw(&pp->pp_ref, -1) == 1)
 		page_free(pp);
 }
 
+//
+// Return a kernel virtual address for the page pp.  Pages below
+// npages_lowmem are always mapped at KERNBASE; any other page is mapped
+// in one of this CPU's kmap slots until the matching kunmap.  Nothing
+// preempts the kernel, so the slots are used like a stack: kunmap must
+// be called in the reverse order of kmap, and at most KMAPSLOTS pages
+// may be mapped at once.
+//
+void *
+kmap(struct PageInfo *pp)
+{
+	uintptr_t va;
+
+	if (pp - pages < npages_lowmem)
+		return page2kva(pp);
+	if (kmap_depth[cpunum()] >= KMAPSLOTS)
+		panic("kmap: out of slots");
+	va = KMAPBASE + (cpunum() * KMAPSLOTS + kmap_depth[cpunum()]++) * PGSIZE;
+	kmap_ptes[PTX(va)] = page2pa(pp) | PTE_W | PTE_P;
+	invlpg((void *) va);
+	return (void *) va;
+}
+
+//
+// Undo kmap.  va is what kmap returned.
+//
+void
+kunmap(void *va)
+{
+	if ((uintptr_t) va < KMAPBASE || (uintptr_t) va >= KMAPBASE + KMAPSIZE)
+		return;
+	assert((uintptr_t) va == KMAPBASE
+	       + (cpunum() * KMAPSLOTS + kmap_depth[cpunum()] - 1) * PGSIZE);
+	kmap_depth[cpunum()]--;
+	kmap_ptes[PTX(va)] = 0;
+	invlpg(va);
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -411,6 +968,9 @@ page_decref(struct PageInfo* pp)
 //	the page is cleared,
 //	and pgdir_walk returns a pointer into the new page table page.
 //
+// If va lies in a 4MB page, there is no PTE, and pgdir_walk returns a
+// pointer to the PDE (which has PTE_PS set) instead.
+//
 // Hint 1: you can turn a PageInfo * into the physical address of the
 // page it refers to with page2pa() from kern/pmap.h.
 //
@@ -432,6 +992,10 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
     pde_t *pde = pgdir + pdx;    // page directory entry, *pde is a physical address
     pde_t *pte;                  // page table entry
 
+    // A 4MB page has no page table; its PDE is the only entry
+    if (*pde & PTE_PS)
+        return pde;
+
     if (*pde & PTE_P) {
         pte = KADDR(PTE_ADDR(*pde));
     } else {
@@ -441,7 +1005,7 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
         if (!pp) return NULL;
 
         pte = (pde_t *) page2kva(pp);
-        pp->pp_ref++;
+        page_incref(pp);
         *pde = PADDR(pte) | PTE_U | PTE_P | PTE_W;
     }
 
@@ -454,6 +1018,10 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // va and pa are both page-aligned.
 // Use permission bits perm|PTE_P for the entries.
 //
+// Where va, pa and the remaining size are all 4MB-aligned, and the
+// processor supports it, this maps a whole 4MB page with one PDE
+// (PTE_PS) instead of filling a page table.
+//
 // This function is only intended to set up the ``static'' mappings
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
@@ -463,12 +1031,21 @@ static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
 	// Fill this function in
-	size_t pg_num = (size % PGSIZE > 0) ? (size / PGSIZE) + 1 : (size / PGSIZE);
-	for (int i = 0; i < pg_num; i++) {
-        pte_t *pte_ptr = pgdir_walk(pgdir, (void *) va, 1);
-        *pte_ptr = pa | perm | PTE_P;
-        va += PGSIZE;
-        pa += PGSIZE;
+	size_t step;
+
+	size = ROUNDUP(size, PGSIZE);
+	while (size > 0) {
+        if (pmap_pse && va % PTSIZE == 0 && pa % PTSIZE == 0 && size >= PTSIZE) {
+            pgdir[PDX(va)] = pa | perm | PTE_P | PTE_PS;
+            step = PTSIZE;
+        } else {
+            pte_t *pte_ptr = pgdir_walk(pgdir, (void *) va, 1);
+            *pte_ptr = pa | perm | PTE_P;
+            step = PGSIZE;
+        }
+        va += step;
+        pa += step;
+        size -= step;
 	}
 }
 
@@ -504,12 +1081,10 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
     pte_t *pte_ptr = pgdir_walk(pgdir, (void *) va, 1);
     if (!pte_ptr) return -E_NO_MEM;
 
-    if (PTE_ADDR(*pte_ptr) != page2pa(pp)) {
-        page_remove(pgdir, (void *) va);
-    } else {
-        pp->pp_ref--;
-    }
-    pp->pp_ref++;
+    // Take the new reference first, so that re-inserting the same
+    // page at the same va cannot free it in page_remove.
+    page_incref(pp);
+    page_remove(pgdir, (void *) va);
     *pte_ptr = page2pa(pp) | perm | PTE_P;
 	return 0;
 }
@@ -529,12 +1104,147 @@ struct PageInfo *
 page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 {
 	// Fill this function in
-    pte_t *pte_ptr = pgdir_walk(pgdir, (void *) va, 1);
-    if (!pte_ptr) return NULL;
+    pte_t *pte_ptr = pgdir_walk(pgdir, (void *) va, 0);
+    if (!pte_ptr || !(*pte_ptr & PTE_P)) return NULL;
     if (pte_store) *pte_store = pte_ptr;
 	return pa2page(*pte_ptr);
 }
 
+//
+// Copy the user mappings below 'end' from srcpgdir into dstpgdir, for
+// fork.  Pages marked PTE_SHARE are shared with the same permissions.
+// Other writable or copy-on-write pages become read-only PTE_COW pages
+// in both page tables.  Read-only pages are shared read-only.
+//
+// The caller must flush srcpgdir's stale TLB entries.
+//
+// Returns 0 on success, or -E_NO_MEM if a page table for dstpgdir
+// could not be allocated.
+//
+int
+pgdir_copy_cow(pde_t *dstpgdir, pde_t *srcpgdir, uintptr_t end)
+{
+	uintptr_t va;
+	pte_t *pt, pte, *dpte;
+	int perm, r;
+
+	for (va = 0; va < end; va += PGSIZE) {
+		if (!(srcpgdir[PDX(va)] & PTE_P)) {
+			// Skip to the next page table
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE - PGSIZE;
+			continue;
+		}
+		pt = (pte_t *) KADDR(PTE_ADDR(srcpgdir[PDX(va)]));
+		pte = pt[PTX(va)];
+		if (PTE_SWAPPED(pte)) {
+			// Both get the page from the same slot
+			if (!(dpte = pgdir_walk(dstpgdir, (void *) va, 1)))
+				return -E_NO_MEM;
+			swap_slot_dup(pte);
+			*dpte = pte;
+			continue;
+		}
+		if ((pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U))
+			continue;
+
+		perm = pte & PTE_SYSCALL;
+		if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW))) {
+			perm = (perm & ~PTE_W) | PTE_COW;
+			pt[PTX(va)] = PTE_ADDR(pte) | perm;
+		}
+		if ((r = page_insert(dstpgdir, pa2page(PTE_ADDR(pte)), (void *) va, perm)) < 0)
+			return r;
+	}
+	return 0;
+}
+
+//
+// Resolve a write fault at 'va' on a copy-on-write page of env.
+// If nobody else maps the page, make it writable again; otherwise
+// give env its own writable copy.
+//
+// Returns 0 if the fault was resolved, -E_INVAL if va is not a
+// copy-on-write page, or -E_NO_MEM if there is no memory for a copy.
+//
+int
+page_cow_fault(struct Env *env, void *va)
+{
+	struct PageInfo *pp, *np;
+	pte_t *pte;
+	void *src, *dst;
+	int perm, r = 0;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	env_lock(env);
+	pte = pgdir_walk(env->env_pgdir, va, 0);
+	if (!pte || (*pte & (PTE_P | PTE_U | PTE_COW)) != (PTE_P | PTE_U | PTE_COW)) {
+		r = -E_INVAL;
+		goto out;
+	}
+
+	pp = pa2page(PTE_ADDR(*pte));
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	if (pp->pp_ref == 1) {
+		// The other side of the fork already has its own copy
+		*pte = PTE_ADDR(*pte) | perm;
+		tlb_invalidate(env->env_pgdir, va);
+	} else if (!(np = page_alloc(ALLOC_HIGHMEM))) {
+		r = -E_NO_MEM;
+	} else {
+		dst = kmap(np);
+		src = kmap(pp);
+		memmove(dst, src, PGSIZE);
+		kunmap(src);
+		kunmap(dst);
+		// Cannot fail: the page table exists.  Drops env's reference to pp.
+		page_insert(env->env_pgdir, np, va, perm);
+	}
+
+out:
+	env_unlock(env);
+	return r;
+}
+
+//
+// Map a zeroed page at 'va' in env if va lies in one of env's
+// demand-zero regions (see sys_mmap_anon) or in the part of the user
+// stack that may grow on demand, and nothing is mapped there yet.
+// Called on the first touch of such a page, either by the page fault
+// handler or by user_mem_check for memory the kernel will use.
+//
+// Returns 0 if a page was mapped, -E_INVAL if va is not an unmapped
+// page of a demand-zero region, or -E_NO_MEM.
+//
+int
+page_anon_fault(struct Env *env, void *va)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int i, perm = 0, r = -E_INVAL;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	env_lock(env);
+	for (i = 0; i < env->env_nanon; i++)
+		if ((uintptr_t) va >= env->env_anon[i].ar_start
+		    && (uintptr_t) va < env->env_anon[i].ar_end) {
+			perm = env->env_anon[i].ar_perm;
+			break;
+		}
+	if ((uintptr_t) va >= env->env_stack_limit && (uintptr_t) va < USTACKTOP)
+		perm = PTE_P | PTE_U | PTE_W;
+
+	// Leave swap entries alone: those pages are swap_in's to restore
+	pte = pgdir_walk(env->env_pgdir, va, 0);
+	if (perm && (!pte || *pte == 0)) {
+		if (!(pp = page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM)))
+			r = -E_NO_MEM;
+		else if ((r = page_insert(env->env_pgdir, pp, va, perm)) < 0)
+			page_free(pp);
+	}
+	env_unlock(env);
+	return r;
+}
+
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
@@ -557,23 +1267,217 @@ page_remove(pde_t *pgdir, void *va)
     pte_t *pte_store = NULL;
     struct PageInfo *pp = page_lookup(pgdir, va, &pte_store);
     if (pp) {
-        page_decref(pp);
-//        if (pp->pp_ref == 0) page_free(pp);
         *pte_store = 0;
         tlb_invalidate(pgdir, va);
+        // No CPU may still reach the page through its TLB when it is
+        // freed, so inside a batch it waits for the shootdown.
+        if (xaddw(&pp->pp_ref, -1) == 1 && !tlb_batch_hold(pgdir, pp))
+            page_free(pp);
+    } else if ((pte_store = pgdir_walk(pgdir, va, 0)) && PTE_SWAPPED(*pte_store)) {
+        // The page is in swap; nothing to invalidate
+        swap_slot_free(*pte_store);
+        *pte_store = 0;
     }
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Invalidate a TLB entry on every CPU that may have it cached: for a
+// user address, the CPUs that have pgdir loaded, and for a kernel
+// address, all of them.  Inside tlb_batch_begin/end on pgdir, the
+// invalidation is only recorded and happens at tlb_batch_end.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
-	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
-		invlpg(va);
+	struct TlbBatch *tb = &tlb_batches[cpunum()];
+	uintptr_t start = ROUNDDOWN((uintptr_t) va, PGSIZE);
+
+	if (tb->tb_depth > 0 && tb->tb_pgdir == pgdir) {
+		if (tb->tb_start >= tb->tb_end) {
+			tb->tb_start = start;
+			tb->tb_end = start + PGSIZE;
+		} else {
+			tb->tb_start = MIN(tb->tb_start, start);
+			tb->tb_end = MAX(tb->tb_end, start + PGSIZE);
+		}
+		return;
+	}
+	tlb_shootdown(pgdir, start, start + PGSIZE);
+}
+
+// Flush [start, end) from this CPU's TLB if it can hold entries for
+// pgdir there.  Kernel mappings are the same in every page directory.
+static void
+tlb_flush_local(pde_t *pgdir, uintptr_t start, uintptr_t end)
+{
+	uintptr_t va;
+
+	if (pgdir != kern_pgdir && thiscpu->cpu_pgdir != pgdir)
+		return;
+	// Reloading %cr3 is cheaper for large ranges, but it leaves
+	// global (kernel) entries alone.
+	if (pgdir != kern_pgdir && end - start > TLB_FLUSH_MAX * PGSIZE) {
+		lcr3(rcr3());
+		return;
+	}
+	for (va = start; va < end; va += PGSIZE)
+		invlpg((void *) va);
+}
+
+//
+// Invalidate [start, end) of pgdir in the TLB of this CPU and of every
+// other CPU that may cache it, and wait until they are all done.  The
+// other CPUs get one IPI each for the whole range.
+//
+void
+tlb_shootdown(pde_t *pgdir, uintptr_t start, uintptr_t end)
+{
+	struct TlbRequest *tr;
+	bool sent[NCPU];
+	int i, me = cpunum();
+
+	// Make the caller's PTE updates visible before looking at which
+	// page directories the other CPUs have loaded (see pgdir_load).
+	asm volatile("lock; addl $0, 0(%%esp)" : : : "memory");
+
+	for (i = 0; i < ncpu; i++) {
+		sent[i] = 0;
+		if (i == me || cpus[i].cpu_status == CPU_UNUSED
+		    || (pgdir != kern_pgdir && cpus[i].cpu_pgdir != pgdir))
+			continue;
+
+		// Another CPU may be using i's slot; serve our own
+		// requests while waiting, or two CPUs could wait on
+		// each other forever.
+		tr = &tlb_requests[i];
+		while (xchg(&tr->tr_lock, 1) != 0) {
+			asm volatile("pause");
+			tlb_shootdown_poll();
+		}
+		tr->tr_pgdir = pgdir;
+		tr->tr_start = start;
+		tr->tr_end = end;
+		xchg(&tr->tr_pending, 1);
+		lapic_ipi_cpu(i, IRQ_OFFSET + IRQ_TLBFLUSH);
+		sent[i] = 1;
+	}
+
+	tlb_flush_local(pgdir, start, end);
+
+	for (i = 0; i < ncpu; i++) {
+		if (!sent[i])
+			continue;
+		tr = &tlb_requests[i];
+		while (tr->tr_pending) {
+			asm volatile("pause");
+			tlb_shootdown_poll();
+		}
+		xchg(&tr->tr_lock, 0);
+	}
+}
+
+//
+// Carry out a TLB shootdown another CPU has asked this one for, if
+// any.  Called from the IPI handler, and from every loop in which a
+// CPU spins with interrupts disabled, since the CPU asking may hold
+// what this one is waiting for.
+//
+void
+tlb_shootdown_poll(void)
+{
+	struct TlbRequest *tr = &tlb_requests[cpunum()];
+
+	if (tr->tr_pending) {
+		tlb_flush_local(tr->tr_pgdir, tr->tr_start, tr->tr_end);
+		xchg(&tr->tr_pending, 0);
+	}
+}
+
+//
+// Collect the invalidations that tlb_invalidate would do on pgdir
+// until the matching tlb_batch_end, and do them in one shootdown.
+// Pages that page_remove frees in the meantime are kept until then.
+// Batches on the same pgdir nest; the caller must hold the lock of
+// the env that owns pgdir throughout.
+//
+void
+tlb_batch_begin(pde_t *pgdir)
+{
+	struct TlbBatch *tb = &tlb_batches[cpunum()];
+
+	if (tb->tb_depth++ == 0) {
+		tb->tb_pgdir = pgdir;
+		tb->tb_start = tb->tb_end = 0;
+	} else
+		assert(tb->tb_pgdir == pgdir);
+}
+
+// Do the batch's shootdown and free the pages it was holding.
+static void
+tlb_batch_flush(struct TlbBatch *tb)
+{
+	struct PageInfo *pp;
+
+	if (tb->tb_start < tb->tb_end)
+		tlb_shootdown(tb->tb_pgdir, tb->tb_start, tb->tb_end);
+	tb->tb_start = tb->tb_end = 0;
+	while ((pp = tb->tb_free)) {
+		tb->tb_free = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+	tb->tb_nfree = 0;
+}
+
+void
+tlb_batch_end(void)
+{
+	struct TlbBatch *tb = &tlb_batches[cpunum()];
+
+	assert(tb->tb_depth > 0);
+	if (--tb->tb_depth == 0) {
+		tlb_batch_flush(tb);
+		tb->tb_pgdir = NULL;
+	}
+}
+
+// If a batch on pgdir is open, keep pp, whose last reference was just
+// dropped, until the batch's shootdown and return 1; otherwise return 0.
+static bool
+tlb_batch_hold(pde_t *pgdir, struct PageInfo *pp)
+{
+	struct TlbBatch *tb = &tlb_batches[cpunum()];
+
+	if (tb->tb_depth == 0 || tb->tb_pgdir != pgdir)
+		return 0;
+	pp->pp_link = tb->tb_free;
+	tb->tb_free = pp;
+	if (++tb->tb_nfree >= TLB_BATCH_MAX)
+		tlb_batch_flush(tb);
+	return 1;
+}
+
+//
+// Load pgdir into %cr3 on this CPU.  Recording it first means any
+// tlb_shootdown that misses this CPU has already updated the PTEs.
+//
+void
+pgdir_load(pde_t *pgdir)
+{
+	xchg((volatile uint32_t *) &thiscpu->cpu_pgdir, (uint32_t) pgdir);
+	lcr3(PADDR(pgdir));
+}
+
+// Return 1 if some CPU has pgdir loaded in %cr3.
+bool
+pgdir_loaded(pde_t *pgdir)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_pgdir == pgdir)
+			return 1;
+	return 0;
 }
 
 //
@@ -613,7 +1517,7 @@ mmio_map_region(physaddr_t pa, size_t size)
     size_t round_size = ROUNDUP(size, PGSIZE);
     if (base + round_size > MMIOLIM)
         panic("reserved region overflow MMIOLIM\n");
-    boot_map_region(kern_pgdir, base, round_size, pa, PTE_PCD | PTE_PWT | PTE_W);
+    boot_map_region(kern_pgdir, base, round_size, pa, PTE_PCD | PTE_PWT | PTE_W | PTE_G);
     void *ret_base = (void *) base;
     base += round_size;
     return ret_base;
@@ -649,6 +1553,12 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
     for (uintptr_t va_cur = va_start; va_cur < va_end; va_cur += PGSIZE) {
         pte_t *pte_store = NULL;
         struct PageInfo *pp = page_lookup(env->env_pgdir, (void *) va_cur, &pte_store);
+        // The kernel is about to touch this page, so fill in
+        // demand-zero and swapped-out memory the way a user fault would
+        if (!pp && va_cur < UTOP
+            && (swap_in(env, (void *) va_cur) == 0
+                || page_anon_fault(env, (void *) va_cur) == 0))
+            pp = page_lookup(env->env_pgdir, (void *) va_cur, &pte_store);
         if (va_cur >= ULIM || !pp || (*pte_store & perm) == 0) {
             user_mem_check_addr = (va_cur == va_start) ? (uintptr_t) va : va_cur;
             return -E_FAULT;
@@ -671,70 +1581,136 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n", env->env_id, user_mem_check_addr);
+		env_lock(env);
 		env_destroy(env);	// may not return
 	}
 }
 
+//
+// Copy len bytes of curenv's memory at va into the kernel buffer dst.
+// A successful user_mem_check only says what the page tables looked
+// like then; another CPU may unmap the range before the copy, so the
+// copy goes through user_copy, which fails instead of faulting.
+// Call this without holding curenv's lock: the copy may need to
+// swap pages back in.
+//
+// Returns 0 on success, -E_FAULT if the memory is not readable.
+//
+int
+user_mem_copyin(void *dst, const void *va, size_t len)
+{
+	if (user_mem_check(curenv, va, len, PTE_U) < 0
+	    || user_copy(dst, va, len) < 0)
+		return -E_FAULT;
+	return 0;
+}
+
+//
+// Like user_mem_copyin, but copies len bytes from the kernel buffer
+// src out to curenv's memory at va.
+//
+// Returns 0 on success, -E_FAULT if the memory is not writable.
+//
+int
+user_mem_copyout(void *va, const void *src, size_t len)
+{
+	if (user_mem_check(curenv, va, len, PTE_U) < 0
+	    || user_copy(va, src, len) < 0)
+		return -E_FAULT;
+	return 0;
+}
+
 
 // --------------------------------------------------------------
 // Checking functions.
 // --------------------------------------------------------------
 
+// Count the free pages in the buddy allocator.
+static int
+page_nfree(void)
+{
+	struct PageInfo *pp;
+	int o, nfree = 0;
+
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		for (pp = page_free_area[o]; pp; pp = pp->pp_link)
+			nfree += 1 << o;
+	return nfree;
+}
+
+// Temporarily take every free page, returning them chained through
+// pp_link, so that a check can run with no free memory.
+static struct PageInfo *
+steal_free_pages(void)
+{
+	struct PageInfo *pp, *fl = NULL;
+
+	while ((pp = page_alloc(0))) {
+		pp->pp_link = fl;
+		fl = pp;
+	}
+	return fl;
+}
+
+// Give back pages taken by steal_free_pages.
+static void
+return_free_pages(struct PageInfo *fl)
+{
+	struct PageInfo *pp;
+
+	while ((pp = fl)) {
+		fl = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+}
+
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *pp, *blk;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
-	int nfree_basemem = 0, nfree_extmem = 0;
+	int o, nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
-
-	// if there's a page that shouldn't be on the free list,
-	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	if (page_nfree() == 0)
+		panic("no free pages!");
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+	for (blk = page_free_area[o]; blk; blk = blk->pp_link) {
+		// check that we didn't corrupt the free lists themselves
+		assert(blk >= pages);
+		assert(blk + (1 << o) <= pages + npages);
+		assert(((char *) blk - (char *) pages) % sizeof(*blk) == 0);
+		assert(blk->pp_free && blk->pp_order == o);
+		assert((blk - pages) % (1 << o) == 0);
+		assert(!blk->pp_link || blk->pp_link->pp_prev == blk);
+
+		for (pp = blk; pp < blk + (1 << o); pp++) {
+			// if there's a page that shouldn't be on the free list,
+			// try to make sure it eventually causes trouble.
+			if (PDX(page2pa(pp)) < pdx_limit)
+				memset(page2kva(pp), 0x97, 128);
+
+			// check a few pages that shouldn't be on the free list
+			assert(pp->pp_ref == 0);
+			assert(page2pa(pp) != 0);
+			assert(page2pa(pp) != IOPHYSMEM);
+			assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+			assert(page2pa(pp) != EXTPHYSMEM);
+			assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+			// (new test for lab 4)
+			assert(page2pa(pp) != MPENTRY_PADDR);
+
+			if (page2pa(pp) < EXTPHYSMEM)
+				++nfree_basemem;
+			else
+				++nfree_extmem;
+		}
 	}
 
 	assert(nfree_basemem > 0);
@@ -760,8 +1736,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = page_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -777,8 +1752,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -806,7 +1780,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -814,13 +1788,59 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(page_nfree() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
 
+//
+// Check that the buddy allocator splits and merges blocks
+// (page_alloc_order() and page_free_order()).
+//
+static void
+check_page_alloc_order(void)
+{
+	struct PageInfo *pp, *pp0, *pp1, *pp2, *pp3, *fl;
+	int nfree;
+
+	nfree = page_nfree();
+
+	// blocks are aligned to their size
+	assert((pp0 = page_alloc_order(3, 0)));
+	assert(page2pa(pp0) % (8 * PGSIZE) == 0);
+	assert(pp0->pp_ref == 0 && !pp0->pp_free);
+
+	// leave only pp0's eight pages free
+	fl = steal_free_pages();
+	assert(!page_alloc(0));
+	page_free_order(pp0, 3);
+	assert(page_nfree() == 8);
+
+	// smaller requests split the block, lowest addresses first
+	assert((pp = page_alloc(0)) && pp == pp0);
+	assert((pp1 = page_alloc_order(1, 0)) && pp1 == pp0 + 2);
+	assert((pp2 = page_alloc(0)) && pp2 == pp0 + 1);
+	assert((pp3 = page_alloc_order(2, 0)) && pp3 == pp0 + 4);
+	assert(!page_alloc(0));
+	assert(!page_alloc_order(4, 0));
+
+	// freeing every piece merges them back into one block
+	page_free(pp2);
+	page_free_order(pp3, 2);
+	page_free(pp);
+	page_free_order(pp1, 1);
+	assert(page_free_area[3] == pp0 && pp0->pp_order == 3);
+	assert(!page_alloc_order(4, 0));
+	assert((pp = page_alloc_order(3, ALLOC_ZERO)) && pp == pp0);
+	assert(((uint32_t *) page2kva(pp))[8 * NPTENTRIES - 1] == 0);
+	page_free_order(pp, 3);
+
+	return_free_pages(fl);
+	assert(page_nfree() == nfree);
+
+	cprintf("check_page_alloc_order() succeeded!\n");
+}
+
 //
 // Checks that the kernel part of virtual address space
 // has been set up roughly correctly (by mem_init()).
@@ -848,7 +1868,7 @@ check_kern_pgdir(void)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
 	// check phys mem
-	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
+	for (i = 0; i < npages_lowmem * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
 	// check kernel stack
@@ -876,6 +1896,8 @@ check_kern_pgdir(void)
 			if (i >= PDX(KERNBASE)) {
 				assert(pgdir[i] & PTE_P);
 				assert(pgdir[i] & PTE_W);
+				// KERNBASE is 4MB-aligned, so this is all 4MB pages
+				assert(!pmap_pse || (pgdir[i] & PTE_PS));
 			} else
 				assert(pgdir[i] == 0);
 			break;
@@ -897,6 +1919,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + (PTX(va) << PTXSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -927,8 +1951,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1048,7 +2071,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1089,7 +2112,8 @@ check_page_installed_pgdir(void)
 	struct PageInfo *fl;
 	pte_t *ptep, *ptep1;
 	uintptr_t va;
-	int i;
+	void *kva;
+	int i, nfree;
 
 	// check that we can read and write installed pages
 	pp1 = pp2 = 0;
@@ -1108,11 +2132,19 @@ check_page_installed_pgdir(void)
 	assert(pp1->pp_ref == 0);
 	*(uint32_t *)PGSIZE = 0x03030303U;
 	assert(*(uint32_t *)page2kva(pp2) == 0x03030303U);
+
+	// inside a TLB batch, the page is only freed after the shootdown
+	nfree = page_nfree();
+	tlb_batch_begin(kern_pgdir);
 	page_remove(kern_pgdir, (void*) PGSIZE);
 	assert(pp2->pp_ref == 0);
+	assert(page_nfree() == nfree);
+	tlb_batch_end();
+	assert(page_nfree() == nfree + 1);
 
-	// forcibly take pp0 back
-	assert(PTE_ADDR(kern_pgdir[0]) == page2pa(pp0));
+	// forcibly take the page table back; the allocator need not
+	// have reused pp0 for it
+	pp0 = pa2page(PTE_ADDR(kern_pgdir[0]));
 	kern_pgdir[0] = 0;
 	assert(pp0->pp_ref == 1);
 	pp0->pp_ref = 0;
@@ -1120,5 +2152,23 @@ check_page_installed_pgdir(void)
 	// free the pages we took
 	page_free(pp0);
 
+	// kmap maps high pages in this CPU's slots, stack fashion, and
+	// returns the KERNBASE address of the others
+	assert((pp0 = page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM)));
+	assert((pp1 = page_alloc(0)));
+	kva = kmap(pp0);
+	assert(*(uint32_t *) kva == 0);
+	*(uint32_t *) kva = 0x04040404U;
+	assert(kmap(pp1) == page2kva(pp1));
+	if (pp0 - pages >= npages_lowmem) {
+		assert(kva == (void *) (KMAPBASE + cpunum() * KMAPSLOTS * PGSIZE));
+		assert(*(uint32_t *) kmap(pp0) == 0x04040404U);
+		kunmap((void *) ((uintptr_t) kva + PGSIZE));
+	}
+	kunmap(page2kva(pp1));
+	kunmap(kva);
+	page_free(pp1);
+	page_free(pp0);
+
 	cprintf("check_page_installed_pgdir() succeeded!\n");
 }
@@ -8,12 +8,14 @@
 
 #include <inc/memlayout.h>
 #include <inc/assert.h>
+#include <kern/cpu.h>
 struct Env;
 
 extern char bootstacktop[], bootstack[];
 
 extern struct PageInfo *pages;
 extern size_t npages;
+extern size_t npages_lowmem;
 
 extern pde_t *kern_pgdir;
 
@@ -34,13 +36,14 @@ _paddr(const char *file, int line, void *kva)
 }
 
 /* This macro takes a physical address and returns the corresponding kernel
- * virtual address.  It panics if you pass an invalid physical address. */
+ * virtual address.  It panics if you pass an invalid physical address, or
+ * one beyond the memory mapped at KERNBASE (use kmap for those). */
 #define KADDR(pa) _kaddr(__FILE__, __LINE__, pa)
 
 static inline void*
 _kaddr(const char *file, int line, physaddr_t pa)
 {
-	if (PGNUM(pa) >= npages)
+	if (PGNUM(pa) >= npages_lowmem)
 		_panic(file, line, "KADDR called with invalid pa %08lx", pa);
 	return (void *)(pa + KERNBASE);
 }
@@ -49,24 +52,71 @@ _kaddr(const char *file, int line, physaddr_t pa)
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1<<0,
+	// For page_alloc, the page may lie beyond the memory mapped at
+	// KERNBASE: the kernel reaches it only through kmap.
+	ALLOC_HIGHMEM = 1<<1,
+};
+
+// Largest block page_alloc_order hands out: 2^10 pages, or 4MB
+#define PAGE_MAX_ORDER	10
+
+// Per-CPU cache of free pages, see page_alloc()
+struct PageMagazine {
+	struct PageInfo *pm_free;	// Free pages, linked by pp_link
+	int pm_count;			// Number of pages on pm_free
+	uint32_t pm_hits;		// Allocs and frees served locally
+	uint32_t pm_refills;		// Batches taken from the buddy lists
+	uint32_t pm_drains;		// Batches returned to the buddy lists
+} __attribute__((aligned(64)));		// One cache line per CPU
+
+extern struct PageMagazine page_mags[NCPU];
+
+// Counters for the pool of pre-zeroed pages, see page_zero_fill()
+struct PageZeroStats {
+	int pz_count;			// Zeroed pages in the pool
+	int pz_high_count;		// Zeroed high memory pages in their pool
+	uint32_t pz_hits;		// ALLOC_ZERO requests served by the pool
+	uint32_t pz_misses;		// ALLOC_ZERO requests cleared synchronously
+	uint32_t pz_fills;		// Pages zeroed by idle CPUs
 };
 
+extern struct PageZeroStats page_zero_stats;
+
 void	mem_init(void);
+void	mem_init_percpu(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
+bool	page_zero_fill(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+int	pgdir_copy_cow(pde_t *dstpgdir, pde_t *srcpgdir, uintptr_t end);
+int	page_cow_fault(struct Env *env, void *va);
+int	page_anon_fault(struct Env *env, void *va);
+void	page_incref(struct PageInfo *pp);
 void	page_decref(struct PageInfo *pp);
+void *	kmap(struct PageInfo *pp);
+void	kunmap(void *va);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_shootdown(pde_t *pgdir, uintptr_t start, uintptr_t end);
+void	tlb_shootdown_poll(void);
+void	tlb_batch_begin(pde_t *pgdir);
+void	tlb_batch_end(void);
+void	pgdir_load(pde_t *pgdir);
+bool	pgdir_loaded(pde_t *pgdir);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int	user_mem_copyin(void *dst, const void *va, size_t len);
+int	user_mem_copyout(void *va, const void *src, size_t len);
+int	user_copy(void *dst, const void *src, size_t len);
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
@@ -5,6 +5,8 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+#include <kern/spinlock.h>
 
 static void
 putch(int ch, int *cnt)
@@ -16,9 +18,16 @@ putch(int ch, int *cnt)
 int
 vcprintf(const char *fmt, va_list ap)
 {
+	extern const char *panicstr;
 	int cnt = 0;
+	// Once we panic, print no matter who holds the lock.
+	bool locked = !panicstr;
 
+	if (locked)
+		spin_lock(&cons_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	if (locked)
+		spin_unlock(&cons_lock);
 	return cnt;
 }
 
@@ -1,77 +1,655 @@
 #include <inc/assert.h>
+#include <inc/error.h>
 #include <inc/x86.h>
 #include <kern/spinlock.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/merge.h>
+#include <kern/kclock.h>
 
-void sched_halt(void);
+// Per-CPU run queues.  A queue holds only ENV_RUNNABLE environments,
+// linked through env_rq_next/env_rq_prev, so picking the next
+// environment costs O(1) no matter how large NENV is.
+//
+// Each CPU does stride scheduling: every time an environment runs, its
+// pass advances by its stride, which is inversely proportional to its
+// weight, and the queue is kept sorted by pass, so the environment
+// that is furthest behind its share runs next.  Environments with the
+// same weight simply take turns.
+//
+// An environment only ever runs on the CPUs in its env_affinity mask.
+// It goes back on the queue of the CPU it last ran on, and an idle CPU
+// steals only environments that have been off their CPU for at least
+// SCHED_MIGRATE_US, so environments tend to stay where their cache
+// is warm.
+//
+// Environments in the deadline class (sys_env_set_deadline) that have
+// budget left in their current period instead go on one queue shared
+// by all CPUs, kept sorted by absolute deadline, and every CPU serves
+// it first: earliest deadline first.  Admission control keeps their
+// total reservation under SCHED_DL_BW_MAX, so a deadline environment
+// runs soon after it wakes up, and one that overruns its budget just
+// competes as best-effort until its next period.
+//
+// There is no periodic tick.  Before running an environment, a CPU
+// sets its one-shot timer to end the time slice only if something else
+// is waiting for it, and an idle CPU halts with its timer off.  Adding
+// an environment to a queue wakes the CPU up, or starts its timer, if
+// it was not going to look at the queue on its own.
+//
+// Queue membership changes only through env_set_status, with the
+// env's lock held, so the lock order is env lock, then run queue lock.
+struct Runqueue {
+	struct spinlock rq_lock;
+	struct Env *rq_head;		// Next env to run (lowest key)
+	struct Env *rq_tail;		// Env with the highest key
+	int rq_len;			// Number of queued envs
+	uint64_t rq_vtime;		// Pass of the env this CPU ran last
+	volatile uint32_t rq_tickless;	// The CPU's timer is off
+};
+
+#define RUNQ_DEADLINE	NCPU		// Index of the deadline queue
+
+static struct Runqueue runqs[NCPU + 1];
+
+// Sum of env_dl_bw over all environments, protected by the deadline
+// queue's lock.
+static uint32_t sched_dl_bw;
+
+uint32_t sched_quantum_us;		// Time slice, see sched_set_quantum
+static uint32_t sched_quantum;		// The same in LAPIC timer counts
+static uint64_t sched_migrate_cost;	// SCHED_MIGRATE_US in TSC cycles
+static uint32_t sched_migrate_ticks;	// The same in LAPIC timer counts
+
+void sched_halt(void) __attribute__((noreturn));
+
+void
+sched_init(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU + 1; i++)
+		__spin_initlock(&runqs[i].rq_lock, "runq");
+}
+
+// Convert the scheduler's time constants to clock ticks.  Call after
+// kclock_init has measured the clocks.
+void
+sched_timer_init(void)
+{
+	sched_migrate_cost = kclock_tsc_hz * SCHED_MIGRATE_US / 1000000;
+	sched_migrate_ticks = (uint64_t) kclock_lapic_hz * SCHED_MIGRATE_US
+		/ 1000000 + 1;
+	if (sched_set_quantum(SCHED_QUANTUM_US) < 0)
+		panic("SCHED_QUANTUM_US %u is out of range", SCHED_QUANTUM_US);
+}
+
+// Make time slices 'us' microseconds long, starting with the next one
+// each CPU begins.  Fails with -E_INVAL unless us is between
+// SCHED_QUANTUM_MIN_US and SCHED_QUANTUM_MAX_US.
+int
+sched_set_quantum(uint32_t us)
+{
+	uint64_t counts;
+
+	if (us < SCHED_QUANTUM_MIN_US || us > SCHED_QUANTUM_MAX_US)
+		return -E_INVAL;
+	counts = (uint64_t) kclock_lapic_hz * us / 1000000;
+	sched_quantum = MAX(MIN(counts, 0xffffffff), 1);
+	sched_quantum_us = us;
+	return 0;
+}
+
+// Return whether e may run on CPU 'cpu'.
+static bool
+sched_allowed(struct Env *e, int cpu)
+{
+	return (e->env_affinity >> cpu) & 1;
+}
+
+// The absolute deadline of e's current period.
+static uint64_t
+sched_dl_deadline(struct Env *e)
+{
+	return e->env_dl_release + e->env_dl_deadline;
+}
+
+// The key run queue 'cpu' is sorted by.
+static uint64_t
+runq_key(struct Env *e, int cpu)
+{
+	return cpu == RUNQ_DEADLINE ? sched_dl_deadline(e) : e->env_pass;
+}
+
+// Insert e into rq after every env whose key is not greater than its
+// own.  Searches from the tail, where an env that just ran belongs.
+// The caller holds rq->rq_lock.
+static void
+runq_insert(struct Runqueue *rq, struct Env *e, int cpu)
+{
+	struct Env *prev;
+	uint64_t key = runq_key(e, cpu);
+
+	for (prev = rq->rq_tail; prev && runq_key(prev, cpu) > key;
+	     prev = prev->env_rq_prev)
+		/* do nothing */;
+	e->env_rq_prev = prev;
+	e->env_rq_next = prev ? prev->env_rq_next : rq->rq_head;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e;
+	else
+		rq->rq_tail = e;
+	if (prev)
+		prev->env_rq_next = e;
+	else
+		rq->rq_head = e;
+	rq->rq_len++;
+	e->env_rq_cpu = cpu;
+}
+
+// Unlink e from rq.  The caller holds rq->rq_lock.
+static void
+runq_unlink(struct Runqueue *rq, struct Env *e)
+{
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail = e->env_rq_prev;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	e->env_rq_cpu = -1;
+	rq->rq_len--;
+}
+
+// Charge a running deadline environment for the time since it was
+// last charged.  The caller holds e's lock.
+static void
+sched_dl_charge(struct Env *e, uint64_t now)
+{
+	e->env_dl_budget -= now - e->env_dl_dispatch;
+	e->env_dl_dispatch = now;
+}
+
+// Return whether deadline environment e may run as one now, starting
+// a new period with a full budget if the current one is over.  A new
+// period starts when e wakes up, not on a fixed grid, so an env that
+// slept through whole periods does not get their budgets back.  The
+// caller holds e's lock.
+static bool
+sched_dl_ready(struct Env *e, uint64_t now)
+{
+	if (!e->env_dl_runtime)
+		return 0;
+	if (now >= e->env_dl_release + e->env_dl_period) {
+		e->env_dl_release = now;
+		e->env_dl_budget = e->env_dl_runtime;
+	}
+	return e->env_dl_budget > 0;
+}
+
+// Get some CPU that e may run on to look at the deadline queue now
+// rather than at its next timer tick: an idle one if there is any,
+// else one running a best-effort environment, which may be this CPU.
+// If every such CPU runs a deadline environment, e waits for its turn.
+static void
+sched_kick(struct Env *e)
+{
+	struct Env *running;
+	int i, target = -1;
+
+	// cpu_status and cpu_env are only hints, read without locks.
+	for (i = 0; i < ncpu; i++) {
+		if (!sched_allowed(e, i))
+			continue;
+		if (cpus[i].cpu_status == CPU_HALTED) {
+			target = i;
+			break;
+		}
+		running = cpus[i].cpu_env;
+		if (target < 0 && (!running || !running->env_dl_runtime))
+			target = i;
+	}
+	if (target >= 0)
+		lapic_ipi_cpu(target, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+// Choose the CPU whose run queue e goes on: the one e last ran on,
+// whose cache may still be warm, else the current CPU, else the first
+// one e may run on.
+static int
+sched_home(struct Env *e)
+{
+	int cpu;
+
+	if (e->env_runs > 0 && sched_allowed(e, e->env_cpunum))
+		return e->env_cpunum;
+	if (sched_allowed(e, cpunum()))
+		return cpunum();
+	for (cpu = 0; cpu < ncpu; cpu++)
+		if (sched_allowed(e, cpu))
+			return cpu;
+	panic("env %08x may run on no CPU", e->env_id);
+}
+
+// Make sure that a CPU gets to e, which was just put on CPU 'cpu's
+// queue, soon.  If that CPU is idle, wake it.  Otherwise, if e is cold
+// enough to move and another CPU is idle, wake that one to steal it.
+// Otherwise, if the CPU is running an environment with its timer off,
+// start the timer if it is us, or make it reschedule right away.
+static void
+sched_notify(struct Env *e, int cpu)
+{
+	int i;
+
+	// cpu_status is only a hint, read without locks; see sched_halt
+	// for why no wakeup is lost.
+	if (cpus[cpu].cpu_status != CPU_HALTED
+	    && read_tsc() - e->env_stop_tsc >= sched_migrate_cost)
+		for (i = 0; i < ncpu; i++)
+			if (i != cpu && sched_allowed(e, i)
+			    && cpus[i].cpu_status == CPU_HALTED) {
+				lapic_ipi_cpu(i, IRQ_OFFSET + IRQ_RESCHED);
+				if (cpu != cpunum())
+					return;
+				break;
+			}
+
+	if (!runqs[cpu].rq_tickless)
+		return;
+	if (cpu == cpunum()) {
+		runqs[cpu].rq_tickless = 0;
+		lapic_timer(sched_quantum);
+	} else
+		lapic_ipi_cpu(cpu, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+// Put a newly runnable environment on a run queue.  A deadline
+// environment with budget left goes on the deadline queue, which all
+// CPUs share; any other goes on the queue chosen by sched_home.
+// 'wakeup' is set if e is new or was blocked, rather than preempted.
+void
+sched_enqueue(struct Env *e, bool wakeup)
+{
+	struct Runqueue *rq;
+	uint64_t credit;
+	int cpu;
+
+	assert(e->env_rq_cpu < 0);
+	if (sched_dl_ready(e, read_tsc())) {
+		rq = &runqs[RUNQ_DEADLINE];
+		spin_lock(&rq->rq_lock);
+		runq_insert(rq, e, RUNQ_DEADLINE);
+		spin_unlock(&rq->rq_lock);
+		sched_kick(e);
+		return;
+	}
+
+	cpu = sched_home(e);
+	rq = &runqs[cpu];
+
+	spin_lock(&rq->rq_lock);
+	// An environment cannot save up CPU time while it is blocked or
+	// new: it starts out level with whatever ran last.  One woken by
+	// an IPC gets a head start of one stride, enough to run before
+	// the environments that were runnable all along, but only if it
+	// has not used up its share, so serving IPCs buys latency but no
+	// extra CPU time.  A preempted environment keeps its pass, which
+	// is what gives heavier environments their larger share, unless
+	// it moves to another CPU, whose passes it cannot be compared to.
+	if (wakeup || cpu != e->env_cpunum) {
+		credit = e->env_ipc_boost ? e->env_stride : 0;
+		if (e->env_pass + credit < rq->rq_vtime)
+			e->env_pass = rq->rq_vtime - credit;
+	}
+	e->env_ipc_boost = 0;
+	runq_insert(rq, e, cpu);
+	spin_unlock(&rq->rq_lock);
+	sched_notify(e, cpu);
+}
+
+// Note that e, which was ENV_RUNNING, is giving up its CPU.  The
+// caller holds e's lock.
+void
+sched_stop(struct Env *e)
+{
+	e->env_stop_tsc = read_tsc();
+	if (e->env_dl_runtime)
+		sched_dl_charge(e, e->env_stop_tsc);
+}
+
+// Restrict e to the CPUs in 'mask', ignoring CPUs that do not exist.
+// A queued e moves to a queue it may be run from; a running e moves
+// the next time it leaves its CPU, see sched_yield.  Fails with
+// -E_INVAL if no CPU is left.  The caller holds e's lock.
+int
+sched_set_affinity(struct Env *e, uint32_t mask)
+{
+	if (ncpu < 32)
+		mask &= (1U << ncpu) - 1;
+	if (!mask)
+		return -E_INVAL;
+	e->env_affinity = mask;
+	if (e->env_status == ENV_RUNNABLE && e->env_rq_cpu != RUNQ_DEADLINE
+	    && !sched_allowed(e, e->env_rq_cpu)) {
+		sched_dequeue(e);
+		sched_enqueue(e, 0);
+	}
+	if (e->env_status == ENV_RUNNING && !sched_allowed(e, e->env_cpunum))
+		sched_preempt(e);
+	return 0;
+}
+
+// Make the CPU running e, which may be this one, enter sched_yield as
+// soon as e is in user mode, so that it notices e's new status or
+// affinity.  The CPU may have its timer off, see sched_run.  The
+// caller holds e's lock.
+void
+sched_preempt(struct Env *e)
+{
+	lapic_ipi_cpu(e->env_cpunum, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+// Put e in the deadline class with the given budget, period and
+// relative deadline, all in TSC cycles, or take it out if runtime is
+// 0.  Fails with -E_NO_MEM if admitting e would reserve more than
+// SCHED_DL_BW_MAX of a CPU.  The caller holds e's lock.
+int
+sched_set_deadline(struct Env *e, uint32_t runtime, uint32_t period,
+		   uint32_t deadline)
+{
+	struct Runqueue *rq = &runqs[RUNQ_DEADLINE];
+	uint32_t bw = 0;
+
+	if (runtime) {
+		if (period < 1000 || deadline < runtime || deadline > period)
+			return -E_INVAL;
+		bw = ROUNDUP(runtime, period / 1000) / (period / 1000);
+	}
+
+	spin_lock(&rq->rq_lock);
+	if (sched_dl_bw - e->env_dl_bw + bw > SCHED_DL_BW_MAX) {
+		spin_unlock(&rq->rq_lock);
+		return -E_NO_MEM;
+	}
+	sched_dl_bw = sched_dl_bw - e->env_dl_bw + bw;
+	spin_unlock(&rq->rq_lock);
+
+	e->env_dl_bw = bw;
+	e->env_dl_runtime = runtime;
+	e->env_dl_period = period;
+	e->env_dl_deadline = deadline;
+	// The first period starts the next time e is queued
+	e->env_dl_release = 0;
+	e->env_dl_budget = 0;
+	e->env_dl_dispatch = read_tsc();
+
+	// Move e to the queue for its new class
+	if (e->env_status == ENV_RUNNABLE) {
+		sched_dequeue(e);
+		sched_enqueue(e, 0);
+	}
+	return 0;
+}
+
+// Remove e from whichever run queue holds it, if any.
+void
+sched_dequeue(struct Env *e)
+{
+	struct Runqueue *rq;
+	int cpu;
+
+	while ((cpu = e->env_rq_cpu) >= 0) {
+		rq = &runqs[cpu];
+		spin_lock(&rq->rq_lock);
+		// e may have been stolen by another CPU before we got the lock
+		if (e->env_rq_cpu == cpu) {
+			runq_unlink(rq, e);
+			spin_unlock(&rq->rq_lock);
+			return;
+		}
+		spin_unlock(&rq->rq_lock);
+	}
+}
+
+// Return the first env on rq that may run on this CPU, without
+// removing it.  Returns NULL if there is none.
+static struct Env *
+runq_peek(struct Runqueue *rq)
+{
+	struct Env *e;
+
+	spin_lock(&rq->rq_lock);
+	for (e = rq->rq_head; e && !sched_allowed(e, cpunum());
+	     e = e->env_rq_next)
+		/* do nothing */;
+	spin_unlock(&rq->rq_lock);
+	return e;
+}
+
+// Return the env on another CPU's queue rq that this CPU should steal,
+// without removing it, or NULL.  We search from the tail, which holds
+// the envs with the highest pass, the ones their own CPU would run
+// last, and skip envs that may not run here or left their CPU too
+// recently to be worth moving.
+static struct Env *
+runq_steal(struct Runqueue *rq, uint64_t now)
+{
+	struct Env *e;
+
+	spin_lock(&rq->rq_lock);
+	for (e = rq->rq_tail; e; e = e->env_rq_prev)
+		if (sched_allowed(e, cpunum())
+		    && now - e->env_stop_tsc >= sched_migrate_cost)
+			break;
+	spin_unlock(&rq->rq_lock);
+	return e;
+}
+
+// Find a runnable environment to move here from the CPU with the
+// longest run queue that has one to spare.  The deadline queue is
+// everyone's and is never stolen from.
+static struct Env *
+sched_steal(void)
+{
+	struct Env *e, *victim = NULL;
+	uint64_t now = read_tsc();
+	int i, len = 0;
+
+	// The lengths are only a hint; runq_steal rechecks under the lock.
+	for (i = 0; i < ncpu; i++)
+		if (i != cpunum() && runqs[i].rq_len > len
+		    && (e = runq_steal(&runqs[i], now))) {
+			victim = e;
+			len = runqs[i].rq_len;
+		}
+	return victim;
+}
+
+// Charge e, which is about to run a time slice on this CPU, one
+// stride.  The caller holds e's lock.
+static void
+sched_charge(struct Env *e)
+{
+	// Only this CPU writes its rq_vtime
+	if (e->env_pass > runqs[cpunum()].rq_vtime)
+		runqs[cpunum()].rq_vtime = e->env_pass;
+	e->env_pass += e->env_stride;
+}
+
+// Claim e, which we found on a run queue, for this CPU by marking it
+// ENV_RUNNING.  Fails if another CPU claimed it first or it stopped
+// being runnable or allowed here while we were not holding its lock.
+static bool
+sched_claim(struct Env *e)
+{
+	bool claimed;
+
+	env_lock(e);
+	claimed = e->env_status == ENV_RUNNABLE && sched_allowed(e, cpunum());
+	if (claimed) {
+		env_set_status(e, ENV_RUNNING);
+		e->env_dl_dispatch = read_tsc();
+		sched_charge(e);
+	}
+	env_unlock(e);
+	return claimed;
+}
+
+// Return whether curenv e, still ENV_RUNNING, should keep this CPU
+// for another time slice as a best-effort environment: no deadline
+// environment is waiting and the next environment on our queue is
+// further ahead in its share than e.  If so, charge e for the slice.
+static bool
+sched_keep(struct Env *e)
+{
+	struct Env *next;
+	bool keep;
+
+	if (runq_peek(&runqs[RUNQ_DEADLINE])
+	    || !(next = runq_peek(&runqs[cpunum()])))
+		return 0;
+	env_lock(e);
+	// next's pass is only a hint, read without its lock
+	keep = e->env_status == ENV_RUNNING && e->env_pass < next->env_pass;
+	if (keep)
+		sched_charge(e);
+	env_unlock(e);
+	return keep;
+}
+
+// Return whether any CPU has an environment waiting to run.  This is
+// only a hint, read without the run queue locks.
+static bool
+sched_work_pending(void)
+{
+	int i;
+
+	if (runqs[RUNQ_DEADLINE].rq_len)
+		return 1;
+	for (i = 0; i < ncpu; i++)
+		if (runqs[i].rq_len)
+			return 1;
+	return 0;
+}
+
+// Return whether curenv, still ENV_RUNNING, should keep this CPU as a
+// deadline environment: it has budget left and no queued deadline
+// environment is due sooner.
+static bool
+sched_dl_keep(struct Env *e)
+{
+	struct Env *next;
+	bool keep;
+
+	if (!e->env_dl_runtime)
+		return 0;
+	env_lock(e);
+	sched_dl_charge(e, read_tsc());
+	keep = e->env_dl_budget > 0;
+	// The queue head's deadline is only a hint, read without its lock
+	if (keep && (next = runq_peek(&runqs[RUNQ_DEADLINE])))
+		keep = sched_dl_deadline(next) >= sched_dl_deadline(e);
+	env_unlock(e);
+	return keep;
+}
+
+// Set this CPU's timer to end e's time slice if another environment
+// is waiting for the CPU or e is a deadline environment, and turn it
+// off otherwise.  Then run e.  A deadline environment's slice ends
+// when its budget runs out, if that comes first.
+static void __attribute__((noreturn))
+sched_run(struct Env *e)
+{
+	struct Runqueue *rq = &runqs[cpunum()];
+	uint64_t counts = sched_quantum;
+
+	if (e->env_dl_runtime && e->env_dl_budget > 0)
+		counts = MIN(counts, e->env_dl_budget * kclock_lapic_hz
+			     / kclock_tsc_hz + 1);
+
+	// Say we are tickless before looking at the queues, so that an
+	// environment queued meanwhile is either seen here or makes
+	// sched_notify start our timer.
+	xchg(&rq->rq_tickless, 1);
+	if (rq->rq_len || runqs[RUNQ_DEADLINE].rq_len || e->env_dl_runtime) {
+		rq->rq_tickless = 0;
+		lapic_timer(counts);
+	} else
+		lapic_timer(0);
+	env_run(e);
+}
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
+	struct Env *e;
+
+	// An environment that may no longer run here, see
+	// sched_set_affinity, goes to a CPU it may run on.
+	if (curenv && curenv->env_status == ENV_RUNNING
+	    && !sched_allowed(curenv, cpunum())) {
+		e = curenv;
+		env_lock(e);
+		env_set_status(e, ENV_RUNNABLE);
+		env_unlock(e);
+	}
+
+	// A deadline environment keeps running until it blocks, uses up
+	// its budget, or one with an earlier deadline shows up.
+	if (curenv && curenv->env_status == ENV_RUNNING && sched_dl_keep(curenv))
+		sched_run(curenv);
+
+	// A best-effort environment keeps running while it is behind the
+	// others in its share, see sched_keep.
+	if (curenv && curenv->env_status == ENV_RUNNING && sched_keep(curenv))
+		sched_run(curenv);
+
+	// Run the deadline environment due soonest, else the next one on
+	// this CPU's run queue.  If our queue is empty, steal work from a
+	// busier CPU.  Environments running on other CPUs are never on a
+	// queue, so they cannot be picked.
+	while ((e = runq_peek(&runqs[RUNQ_DEADLINE]))
+	       || (e = runq_peek(&runqs[cpunum()])) || (e = sched_steal()))
+		if (sched_claim(e))
+			sched_run(e);
+
+	// Free the environment previously running on this CPU if another
+	// CPU destroyed it; nobody else may free it while it is ours.
+	if (curenv && curenv->env_status == ENV_DYING) {
+		e = curenv;
+		env_lock(e);
+		env_free(e);
+		curenv = NULL;
+		env_unlock(e);
+	}
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
 	// If no envs are runnable, but the environment previously
 	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment. Make sure curenv is not null before
-	// dereferencing it.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-	idle = (curenv == NULL) ? envs : curenv + 1;
-    struct Env *e = idle;
-    for (; e < envs + NENV; e++) {
-        if (e->env_status == ENV_RUNNABLE) {
-            env_run(e);
-            return;
-        }
-    }
-
-    for (e = envs; e < idle; e++) {
-        if (e->env_status == ENV_RUNNABLE) {
-            env_run(e);
-            return;
-        }
-    }
-
-    if (curenv && curenv->env_status == ENV_RUNNING) {
-        env_run(curenv);
-        return;
-    }
+	// choose that environment.
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		sched_run(curenv);
 
 	// sched_halt never returns
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// Halt this CPU when there is nothing to do. Wait until an IPI or
+// the timer interrupt wakes it up. This function never returns.
 //
 void
 sched_halt(void)
 {
-	int i;
+	bool merging = false;
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
-			break;
-	}
-	if (i == NENV) {
+	if (env_nactive == 0) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
@@ -79,15 +657,45 @@ sched_halt(void)
 
 	// Mark that no environment is running on this CPU
 	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	pgdir_load(kern_pgdir);
+
+	// Use the idle time to free the memory of dead environments and
+	// to clear pages for page_alloc(ALLOC_ZERO), but stop as soon as
+	// there is something to run.
+	while (!sched_work_pending() && (env_reap() || page_zero_fill()))
+		/* do nothing */;
+	// Then take one step of same-page merging.
+	if (!sched_work_pending())
+		merging = merge_scan();
 
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// Mark that this CPU is in the HALT state.  Do this before looking
+	// at the queues one last time, so that an environment queued
+	// meanwhile is either seen here or makes sched_notify wake us.
+	xchg(&runqs[cpunum()].rq_tickless, 1);
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// If something we can run showed up meanwhile, go run it, starting
+	// over on a fresh stack as the halt below would.
+	if (runq_peek(&runqs[RUNQ_DEADLINE]) || runq_peek(&runqs[cpunum()])
+	    || sched_steal()) {
+		xchg(&thiscpu->cpu_status, CPU_STARTED);
+		asm volatile (
+			"movl $0, %%ebp\n"
+			"movl %0, %%esp\n"
+			"pushl $0\n"
+			"pushl $0\n"
+			"jmp sched_yield\n"
+		: : "a" (thiscpu->cpu_ts.ts_esp0));
+	}
+
+	// Sleep until someone wakes us.  Work on other CPUs that was too
+	// recently off its CPU to steal is worth another look once it has
+	// cooled down, and while merging is still finding pages, come back
+	// for another step after a time slice.
+	if (sched_work_pending())
+		lapic_timer(sched_migrate_ticks);
+	else
+		lapic_timer(merging ? sched_quantum : 0);
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -101,5 +709,6 @@ sched_halt(void)
 		"hlt\n"
 		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("sched_halt returned");  /* mostly to placate the compiler */
 }
 
@@ -6,6 +6,42 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
+// An environment of weight w advances its pass by SCHED_STRIDE1 / w
+// each time it runs, see sched_enqueue.
+#define SCHED_STRIDE1	(1 << 20)
+
+// Length of a time slice in microseconds at boot, see
+// sched_set_quantum.  The build sets it from QUANTUM_US.
+#ifndef SCHED_QUANTUM_US
+#define SCHED_QUANTUM_US	10000
+#endif
+#define SCHED_QUANTUM_MIN_US	100
+#define SCHED_QUANTUM_MAX_US	1000000
+
+// An idle CPU does not steal an environment that left its own CPU less
+// than this many microseconds ago: its cache is probably still warm
+// there, and the CPU will likely get to it soon.
+#define SCHED_MIGRATE_US	250
+
+extern uint32_t sched_quantum_us;
+
+// Deadline environments together may reserve at most this much of one
+// CPU, in per mille, so best-effort environments never starve.
+#define SCHED_DL_BW_MAX	900
+
+void sched_init(void);
+void sched_timer_init(void);
+int sched_set_quantum(uint32_t us);
+void sched_enqueue(struct Env *e, bool wakeup);
+void sched_dequeue(struct Env *e);
+void sched_stop(struct Env *e);
+void sched_preempt(struct Env *e);
+int sched_set_affinity(struct Env *e, uint32_t mask);
+int sched_set_deadline(struct Env *e, uint32_t runtime, uint32_t period,
+		       uint32_t deadline);
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
@@ -8,13 +8,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
-
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
+#include <kern/pmap.h>
 
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
@@ -68,8 +62,11 @@ spin_lock(struct spinlock *lk)
 	// The xchg is atomic.
 	// It also serializes, so that reads after acquire are not
 	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
+	// The holder may be waiting for this CPU to flush its TLB.
+	while (xchg(&lk->locked, 1) != 0) {
 		asm volatile ("pause");
+		tlb_shootdown_poll();
+	}
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -78,6 +75,20 @@ spin_lock(struct spinlock *lk)
 #endif
 }
 
+// Acquire the lock if nobody holds it, including this CPU.
+// Returns 1 if the lock was acquired, 0 otherwise.
+bool
+spin_trylock(struct spinlock *lk)
+{
+	if (xchg(&lk->locked, 1) != 0)
+		return 0;
+#ifdef DEBUG_SPINLOCK
+	lk->cpu = thiscpu;
+	get_caller_pcs(lk->pcs);
+#endif
+	return 1;
+}
+
 // Release the lock.
 void
 spin_unlock(struct spinlock *lk)
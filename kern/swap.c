@@ -0,0 +1,259 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/swap.h>
+#include <kern/ide.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kmalloc.h>
+#include <kern/spinlock.h>
+
+// Paging to the kernel's disk (see kern/ide.c).  When page_alloc runs
+// out of memory it calls swap_out, which sweeps the user pages of
+// environments that are not running, clock-style: a page whose PTE_A
+// bit is set gets the bit cleared and a second chance, and a page that
+// has not been touched since is written to a free slot and its PTE
+// replaced by a swap entry (see PTE_SWAPPED).  The next touch faults,
+// and swap_in reads the page back.
+//
+// Only pages with a single mapping are paged out, so a swap entry
+// always stands for a private page.  sys_fork duplicates swap entries,
+// which is why slots are reference counted.
+
+#define SWAP_SECTS	(PGSIZE / SECTSIZE)	// Sectors per slot
+#define SWAP_MAX_SLOTS	65536			// Use at most 256MB of disk
+#define SWAP_SCAN_MAX	(4 * NPTENTRIES)	// PTEs examined per swap_out
+#define SWAP_PERM	(PTE_U | PTE_W | PTE_COW)	// Kept in swap entries
+
+struct SwapStats swap_stats;
+
+static uint8_t *swap_map;		// Slot reference counts; slot 0 unused
+static uint32_t swap_next;		// Where to look for a free slot next
+static int swap_hand_env;		// Where swap_out resumes its sweep
+static uintptr_t swap_hand_va;
+static struct spinlock swap_lock;	// Protects all of the above
+
+void
+swap_init(void)
+{
+	uint32_t nslots = MIN(ide_init() / SWAP_SECTS, SWAP_MAX_SLOTS);
+
+	__spin_initlock(&swap_lock, "swap_lock");
+	if (nslots < 2)
+		return;
+	if (!(swap_map = kmalloc(nslots)))
+		panic("swap_init: out of memory");
+	memset(swap_map, 0, nslots);
+	swap_map[0] = 1;
+	swap_stats.sw_nslots = nslots;
+	cprintf("swap: %d slots\n", nslots);
+}
+
+// Allocate a free slot, or return 0 if swap is full.
+static uint32_t
+swap_slot_alloc(void)
+{
+	uint32_t i, slot = 0;
+
+	spin_lock(&swap_lock);
+	for (i = 0; i < swap_stats.sw_nslots; i++) {
+		swap_next = (swap_next + 1) % swap_stats.sw_nslots;
+		if (swap_map[swap_next] == 0) {
+			slot = swap_next;
+			swap_map[slot] = 1;
+			swap_stats.sw_used++;
+			break;
+		}
+	}
+	spin_unlock(&swap_lock);
+	return slot;
+}
+
+// Take another reference on the slot of swap entry pte.
+void
+swap_slot_dup(pte_t pte)
+{
+	uint32_t slot = PGNUM(pte);
+
+	spin_lock(&swap_lock);
+	assert(swap_map[slot] > 0);
+	if (swap_map[slot] == 255)
+		panic("swap_slot_dup: too many references to slot %d", slot);
+	swap_map[slot]++;
+	spin_unlock(&swap_lock);
+}
+
+// Drop a reference on the slot of swap entry pte.
+void
+swap_slot_free(pte_t pte)
+{
+	uint32_t slot = PGNUM(pte);
+
+	spin_lock(&swap_lock);
+	assert(slot > 0 && swap_map[slot] > 0);
+	if (--swap_map[slot] == 0)
+		swap_stats.sw_used--;
+	spin_unlock(&swap_lock);
+}
+
+// Read or write page pp from or to slot.
+static int
+swap_io(uint32_t slot, struct PageInfo *pp, bool write)
+{
+	void *va = kmap(pp);
+	int r;
+
+	if (write)
+		r = ide_write(slot * SWAP_SECTS, va, SWAP_SECTS);
+	else
+		r = ide_read(slot * SWAP_SECTS, va, SWAP_SECTS);
+	kunmap(va);
+	return r;
+}
+
+// Page out up to n pages of e, which must be locked, scanning from *va
+// up and advancing *va.  Stops early once *budget PTEs have been
+// examined or swap is full, in which case it sets *budget to 0.
+// Returns the number of pages paged out.
+static int
+swap_out_env(struct Env *e, uintptr_t *va, int n, int *budget)
+{
+	struct PageInfo *pp;
+	pte_t *pte, old;
+	uint32_t slot;
+	int done = 0;
+
+	for (; *va < UTOP && done < n && *budget > 0; *va += PGSIZE) {
+		if (!(e->env_pgdir[PDX(*va)] & PTE_P)) {
+			// Skip to the next page table
+			*va = ROUNDDOWN(*va, PTSIZE) + PTSIZE - PGSIZE;
+			continue;
+		}
+		(*budget)--;
+		pte = (pte_t *) KADDR(PTE_ADDR(e->env_pgdir[PDX(*va)])) + PTX(*va);
+		if ((*pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U) || (*pte & PTE_SHARE))
+			continue;
+		pp = pa2page(PTE_ADDR(*pte));
+		if (pp->pp_ref != 1)
+			continue;
+
+		// Second chance for pages used since the last sweep.  The
+		// TLB may still have PTE_A set, which only makes the page
+		// look idle a little longer.
+		if (*pte & PTE_A) {
+			*pte &= ~PTE_A;
+			continue;
+		}
+
+		if (!(slot = swap_slot_alloc())) {
+			*budget = 0;
+			break;
+		}
+		// Unmap the page before writing it, so it cannot change
+		// under the write.
+		old = *pte;
+		*pte = (slot << PGSHIFT) | (old & SWAP_PERM) | PTE_SWAP;
+		tlb_invalidate(e->env_pgdir, (void *) *va);
+		if (swap_io(slot, pp, 1) < 0) {
+			swap_slot_free(*pte);
+			*pte = old;
+			*budget = 0;
+			break;
+		}
+		page_decref(pp);
+		swap_stats.sw_outs++;
+		done++;
+	}
+	return done;
+}
+
+//
+// Free up to npages pages by writing them to swap.  Environments that
+// are dying or not yet started are left alone, as are those whose lock
+// someone else holds, since the caller may hold env locks of its own.
+// A running environment's pages may go too: if the kernel touches one
+// of them on the environment's behalf, page_fault_handler reads it
+// back in.
+//
+// Returns the number of pages freed.
+//
+int
+swap_out(int npages)
+{
+	struct Env *e;
+	uintptr_t va;
+	int i, idx, done = 0, budget = SWAP_SCAN_MAX;
+
+	if (swap_stats.sw_nslots == 0)
+		return 0;
+
+	spin_lock(&swap_lock);
+	idx = swap_hand_env;
+	va = swap_hand_va;
+	spin_unlock(&swap_lock);
+
+	for (i = 0; i <= NENV && done < npages && budget > 0; i++) {
+		e = &envs[idx];
+		if (env_trylock(e)) {
+			if ((e->env_status == ENV_RUNNABLE
+			     || e->env_status == ENV_RUNNING
+			     || e->env_status == ENV_NOT_RUNNABLE)
+			    && e->env_runs > 0)
+				done += swap_out_env(e, &va, npages - done, &budget);
+			else
+				va = UTOP;
+			env_unlock(e);
+		}
+		if (done >= npages || budget == 0)
+			break;
+		idx = (idx + 1) % NENV;
+		va = 0;
+	}
+
+	spin_lock(&swap_lock);
+	swap_hand_env = idx;
+	swap_hand_va = va;
+	spin_unlock(&swap_lock);
+	return done;
+}
+
+//
+// Read the page at 'va' in env back from swap.  Called on a fault on a
+// swap entry, and wherever the kernel is about to use such a page.
+//
+// Returns 0 on success, -E_INVAL if va is not swapped out, -E_NO_MEM,
+// or -E_FAULT if the disk fails.
+//
+int
+swap_in(struct Env *env, void *va)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r = 0;
+
+	if (swap_stats.sw_nslots == 0)
+		return -E_INVAL;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	env_lock(env);
+	pte = pgdir_walk(env->env_pgdir, va, 0);
+	if (!pte || !PTE_SWAPPED(*pte))
+		r = -E_INVAL;
+	else if (!(pp = page_alloc(ALLOC_HIGHMEM)))
+		r = -E_NO_MEM;
+	else if (swap_io(PGNUM(*pte), pp, 0) < 0) {
+		page_free(pp);
+		r = -E_FAULT;
+	} else {
+		swap_slot_free(*pte);
+		*pte = page2pa(pp) | (*pte & SWAP_PERM) | PTE_A | PTE_P;
+		page_incref(pp);
+		swap_stats.sw_ins++;
+	}
+	env_unlock(env);
+	return r;
+}
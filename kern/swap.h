@@ -0,0 +1,34 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SWAP_H
+#define JOS_KERN_SWAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/memlayout.h>
+struct Env;
+
+// A user PTE without PTE_P but with PTE_SWAP says the page is in swap:
+// PTE_ADDR(pte) >> PGSHIFT is its slot, and the permission bits are
+// the ones the page gets back when it is read in.
+#define PTE_SWAP	0x200
+#define PTE_SWAPPED(pte)	(((pte) & (PTE_P | PTE_SWAP)) == PTE_SWAP)
+
+// Counters for the swap area, see swap_out()
+struct SwapStats {
+	uint32_t sw_nslots;		// Page-sized slots on the swap disk
+	uint32_t sw_used;		// Slots holding a page
+	uint32_t sw_outs;		// Pages written out
+	uint32_t sw_ins;		// Pages read back in
+};
+
+extern struct SwapStats swap_stats;
+
+void	swap_init(void);
+int	swap_out(int npages);
+int	swap_in(struct Env *env, void *va);
+void	swap_slot_dup(pte_t pte);
+void	swap_slot_free(pte_t pte);
+
+#endif // !JOS_KERN_SWAP_H
@@ -11,6 +11,8 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/swap.h>
+#include <kern/kclock.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -18,14 +20,23 @@
 static void
 sys_cputs(const char *s, size_t len)
 {
+	char buf[128];
+	size_t n;
+
 	// Check that the user has permission to read memory [s, s+len).
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
     user_mem_assert(curenv, s, len, PTE_P | PTE_U);
 
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	// Print the string supplied by the user.  Print a kernel copy,
+	// since another CPU may unmap the string while we print it.
+	for (; len > 0; s += n, len -= n) {
+		n = MIN(len, sizeof(buf));
+		if (user_mem_copyin(buf, s, n) < 0)
+			return;
+		cprintf("%.*s", n, buf);
+	}
 }
 
 // Read a character from the system console without blocking.
@@ -54,7 +65,7 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	if ((r = envid2env_lock(envid, &e, 1)) < 0)
 		return r;
     if (e == curenv)
         cprintf("[%08x] exiting gracefully\n", curenv->env_id);
@@ -90,15 +101,80 @@ sys_exofork(void)
     struct Env *newenv_store = NULL;
     int res = env_alloc(&newenv_store, curenv->env_id);
     if (res == 0) {
-        newenv_store->env_status = ENV_NOT_RUNNABLE;
+        // env_alloc leaves the new env ENV_NOT_RUNNABLE
         newenv_store->env_tf = curenv->env_tf;
         newenv_store->env_tf.tf_regs.reg_eax = 0;
+        newenv_store->env_weight = curenv->env_weight;
+        newenv_store->env_stride = curenv->env_stride;
+        newenv_store->env_affinity = curenv->env_affinity;
         return newenv_store->env_id;
     }
 
     return res;
 }
 
+// Create a copy-on-write copy of the current environment, as lib's
+// fork() used to do with sys_exofork and a pair of sys_page_maps per
+// page.  The child gets a copy of our page tables below USTACKTOP (see
+// pgdir_copy_cow), a fresh user exception stack, our page fault
+// upcall, and is marked runnable.  Like sys_exofork, it appears to
+// return 0 in the child.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *e = curenv, *child;
+	struct PageInfo *pp;
+	envid_t envid;
+	int r;
+
+	if ((r = env_alloc(&child, e->env_id)) < 0)
+		return r;
+	envid = child->env_id;
+	child->env_tf = e->env_tf;
+	child->env_tf.tf_regs.reg_eax = 0;
+	child->env_pgfault_upcall = e->env_pgfault_upcall;
+
+	// The exception stack is never copy-on-write
+	r = -E_NO_MEM;
+	if (!(pp = page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM)))
+		goto bad;
+	if ((r = page_insert(child->env_pgdir, pp, (void *) (UXSTACKTOP - PGSIZE),
+			     PTE_P | PTE_U | PTE_W)) < 0) {
+		page_free(pp);
+		goto bad;
+	}
+
+	// Nobody else can see the child until it is runnable, but other
+	// CPUs may map pages into our address space.
+	env_lock(e);
+	memmove(child->env_anon, e->env_anon, sizeof(e->env_anon));
+	child->env_nanon = e->env_nanon;
+	child->env_stack_limit = e->env_stack_limit;
+	child->env_weight = e->env_weight;
+	child->env_stride = e->env_stride;
+	child->env_affinity = e->env_affinity;
+	r = pgdir_copy_cow(child->env_pgdir, e->env_pgdir, USTACKTOP);
+	// Flush the writable mappings that are now copy-on-write
+	pgdir_load(e->env_pgdir);
+	env_unlock(e);
+	if (r < 0)
+		goto bad;
+
+	env_lock(child);
+	env_set_status(child, ENV_RUNNABLE);
+	env_unlock(child);
+	return envid;
+
+bad:
+	env_lock(child);
+	env_destroy(child);
+	return r;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -122,22 +198,36 @@ sys_env_set_status(envid_t envid, int status)
         return -E_INVAL;
 
     struct Env *env_store = NULL;
-    int res = envid2env(envid, &env_store, 1);
-    if (res == 0) {
-        env_store->env_status = status;
-        return 0;
+    int res = envid2env_lock(envid, &env_store, 1);
+    if (res < 0)
+        return res;
+
+    // An environment running on another CPU, or dying, is left alone:
+    // it is already runnable, and stopping it would need its CPU.
+    if (env_store != curenv && (env_store->env_status == ENV_RUNNING ||
+                                env_store->env_status == ENV_DYING)) {
+        env_unlock(env_store);
+        return status == ENV_RUNNABLE ? 0 : -E_INVAL;
     }
 
-    return res;
+    // Once we stop running, another CPU may run us before trap_dispatch
+    // could store our return value, so store it now.
+    if (env_store == curenv)
+        env_store->env_tf.tf_regs.reg_eax = 0;
+    env_set_status(env_store, status);
+    env_unlock(env_store);
+    return 0;
 }
 
 // Set envid's trap frame to 'tf'.
-// tf is modified to make sure that user environments always run at code
-// protection level 3 (CPL 3), interrupts enabled, and IOPL of 0.
+// The kernel's copy of tf is modified to make sure that user environments
+// always run at code protection level 3 (CPL 3) with user segments,
+// interrupts enabled, and IOPL of 0.  The caller's tf is left alone.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
+//	-E_FAULT if tf went away while it was being read.
 static int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -147,17 +237,26 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 //	panic("sys_env_set_trapframe not implemented");
 
     struct Env *env_store = NULL;
+    struct Trapframe ktf;
     int r = envid2env(envid, &env_store, 1);
-    if (r == 0) {
-        user_mem_assert(curenv, tf, sizeof(struct Trapframe), PTE_P | PTE_U);
-        tf->tf_cs |= 0x3;
-        tf->tf_eflags &= FL_IOPL_0;
-        tf->tf_eflags |= FL_IF;
-        env_store->env_tf = *tf;
-        return 0;
-    }
-
-    return r;
+    if (r < 0)
+        return r;
+
+    // Read tf before taking any lock: the read may have to swap
+    // the page back in, which takes curenv's lock.
+    user_mem_assert(curenv, tf, sizeof(struct Trapframe), PTE_P | PTE_U);
+    if ((r = user_mem_copyin(&ktf, tf, sizeof(ktf))) < 0)
+        return r;
+    ktf.tf_cs = GD_UT | 3;
+    ktf.tf_ds = ktf.tf_es = ktf.tf_ss = GD_UD | 3;
+    ktf.tf_eflags &= ~FL_IOPL_MASK;
+    ktf.tf_eflags |= FL_IF;
+
+    if ((r = envid2env_lock(envid, &env_store, 1)) < 0)
+        return r;
+    env_store->env_tf = ktf;
+    env_unlock(env_store);
+    return 0;
 }
 
 // Set the page fault upcall for 'envid' by modifying the corresponding struct
@@ -175,9 +274,10 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //	panic("sys_env_set_pgfault_upcall not implemented");
 
     struct Env *env_store = NULL;
-    int res = envid2env(envid, &env_store, 1);
+    int res = envid2env_lock(envid, &env_store, 1);
     if (res == 0) {
         env_store->env_pgfault_upcall = func;
+        env_unlock(env_store);
         return 0;
     }
 
@@ -226,11 +326,17 @@ sys_page_alloc(envid_t envid, void *va, int perm)
     if ((uintptr_t) va >= UTOP || (uintptr_t) va % PGSIZE > 0)
         return -E_INVAL;
 
-    struct PageInfo *pp = page_alloc(ALLOC_ZERO);
+    // Zero the page before taking the env's lock
+    struct PageInfo *pp = page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM);
     if (!pp)
         return -E_NO_MEM;
 
+    if (envid2env_lock(envid, &env_store, 1) < 0) {
+        page_free(pp);
+        return -E_BAD_ENV;
+    }
     int res = page_insert(env_store->env_pgdir, pp, va, perm);
+    env_unlock(env_store);
     if (res < 0) {
         page_free(pp);
         return -E_NO_MEM;
@@ -243,7 +349,9 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
 // that it also must not grant write access to a read-only
-// page.
+// page.  A copy-on-write (PTE_COW) page counts as writable: if perm
+// has PTE_W, srcenvid first gets its own writable copy of the page,
+// as if it had written to it, and that copy is what gets mapped.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
@@ -253,7 +361,7 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL is srcva is not mapped in srcenvid's address space.
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
-//		address space.
+//		address space and not copy-on-write.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
@@ -291,19 +399,38 @@ sys_page_map(envid_t srcenvid, void *srcva,
     if ((uintptr_t) dstva >= UTOP || (uintptr_t) dstva % PGSIZE > 0)
         return -E_INVAL;
 
+    // Never hold both envs' locks at once: take a reference on the
+    // source page under the source's lock, so it cannot be freed
+    // before we map it into the destination.  A copy-on-write page
+    // is writable as far as the environment is concerned (it may have
+    // been merged with others, see kern/merge.c), so copy it first.
+    swap_in(srcenv_store, srcva);
+    if (perm & PTE_W)
+        page_cow_fault(srcenv_store, srcva);
+    if (envid2env_lock(srcenvid, &srcenv_store, 1) < 0)
+        return -E_BAD_ENV;
     pte_t *pte_store = NULL;
     struct PageInfo *pp = page_lookup(srcenv_store->env_pgdir, srcva, &pte_store);
-    if (!pp)
+    if (!pp) {
+        env_unlock(srcenv_store);
         return -E_INVAL;
-
-    if ((perm & PTE_W) && (*pte_store & PTE_W) == 0)
+    }
+    if ((perm & PTE_W) && (*pte_store & PTE_W) == 0) {
+        env_unlock(srcenv_store);
         return -E_INVAL;
+    }
+    page_incref(pp);
+    env_unlock(srcenv_store);
 
-    res = page_insert(dstenv_store->env_pgdir, pp, dstva, perm);
-    if (res < 0)
-        return -E_NO_MEM;
-
-    return 0;
+    res = envid2env_lock(dstenvid, &dstenv_store, 1);
+    if (res == 0) {
+        res = page_insert(dstenv_store->env_pgdir, pp, dstva, perm);
+        env_unlock(dstenv_store);
+        if (res < 0)
+            res = -E_NO_MEM;
+    }
+    page_decref(pp);
+    return res;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -329,13 +456,378 @@ sys_page_unmap(envid_t envid, void *va)
     if ((uintptr_t) va >= UTOP || (uintptr_t) va % PGSIZE > 0)
         return -E_INVAL;
 
+    if (envid2env_lock(envid, &env_store, 1) < 0)
+        return -E_BAD_ENV;
+
     page_remove(env_store->env_pgdir, va);
+    env_unlock(env_store);
     return 0;
 }
 
+// The vectored page system calls below do their work in batches of
+// up to PAGE_BATCH pages, taking each env's lock once per batch.
+#define PAGE_BATCH	64
+
+// Is perm acceptable for a page mapped by a system call?
+static bool
+page_perm_ok(int perm)
+{
+	return (perm & ~PTE_SYSCALL) == 0 && (perm & (PTE_U | PTE_P)) == (PTE_U | PTE_P);
+}
+
+// Is va a page-aligned address below UTOP?
+static bool
+page_va_ok(void *va)
+{
+	return (uintptr_t) va < UTOP && (uintptr_t) va % PGSIZE == 0;
+}
+
+// Apply n sys_page_map operations from srcenvid to dstenvid in one
+// system call.  Entry i maps the page at ents[i].pme_srcva in srcenvid
+// at ents[i].pme_dstva in dstenvid with permission ents[i].pme_perm,
+// with the same checks as sys_page_map, and breaks copy-on-write on
+// the source the same way.  Stops at the first entry that fails.
+//
+// Returns the number of entries mapped, if any; otherwise the error
+// that the first entry failed with:
+//	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
+//		or the caller doesn't have permission to change one of them.
+//	-E_INVAL for a bad address or permission, or for PTE_W on a
+//		read-only page that is not copy-on-write (see sys_page_map).
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+//	-E_FAULT if ents went away while it was being read.
+static int
+sys_page_map_batch(envid_t srcenvid, envid_t dstenvid,
+		   const struct PageMapEntry *ents, size_t n)
+{
+	struct PageMapEntry batch[PAGE_BATCH];
+	struct PageInfo *pps[PAGE_BATCH];
+	struct PageMapEntry *pme;
+	struct Env *e;
+	pte_t *pte;
+	size_t done = 0, i, m;
+	int r = 0;
+
+	if (n > UTOP / sizeof(*ents))
+		return -E_INVAL;
+	user_mem_assert(curenv, ents, n * sizeof(*ents), PTE_U);
+	if (envid2env(srcenvid, &e, 1) < 0 || envid2env(dstenvid, &e, 1) < 0)
+		return -E_BAD_ENV;
+
+	while (done < n && r == 0) {
+		m = MIN(n - done, PAGE_BATCH);
+		if (user_mem_copyin(batch, ents + done, m * sizeof(batch[0])) < 0)
+			return done > 0 ? done : -E_FAULT;
+
+		// As in sys_page_map, take references on the source pages
+		// under the source's lock, then map them under the
+		// destination's lock, never holding both.
+		if (envid2env(srcenvid, &e, 1) == 0)
+			for (i = 0; i < m; i++)
+				if (page_va_ok(batch[i].pme_srcva)) {
+					swap_in(e, batch[i].pme_srcva);
+					if (batch[i].pme_perm & PTE_W)
+						page_cow_fault(e, batch[i].pme_srcva);
+				}
+		if (envid2env_lock(srcenvid, &e, 1) < 0)
+			return done > 0 ? done : -E_BAD_ENV;
+		for (i = 0; i < m; i++) {
+			pme = &batch[i];
+			if (!page_perm_ok(pme->pme_perm) || !page_va_ok(pme->pme_srcva)
+			    || !page_va_ok(pme->pme_dstva)
+			    || !(pps[i] = page_lookup(e->env_pgdir, pme->pme_srcva, &pte))
+			    || ((pme->pme_perm & PTE_W) && !(*pte & PTE_W))) {
+				r = -E_INVAL;
+				break;
+			}
+			page_incref(pps[i]);
+		}
+		env_unlock(e);
+		m = i;
+
+		if (envid2env_lock(dstenvid, &e, 1) < 0) {
+			r = -E_BAD_ENV;
+			i = 0;
+		} else {
+			tlb_batch_begin(e->env_pgdir);
+			for (i = 0; i < m; i++)
+				if (page_insert(e->env_pgdir, pps[i], batch[i].pme_dstva,
+						batch[i].pme_perm) < 0) {
+					r = -E_NO_MEM;
+					break;
+				}
+			tlb_batch_end();
+			env_unlock(e);
+		}
+		done += i;
+		for (i = 0; i < m; i++)
+			page_decref(pps[i]);
+	}
+	return done > 0 ? done : r;
+}
+
+// Allocate zeroed pages at the npages pages starting at va in envid,
+// as npages calls to sys_page_alloc would.  Stops at the first
+// failure.
+//
+// Returns the number of pages mapped, if any; otherwise < 0 on error.
+// Errors are as for sys_page_alloc.
+static int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	struct PageInfo *pps[PAGE_BATCH];
+	struct Env *e;
+	size_t done = 0, i, m;
+	int r = 0;
+
+	if (!page_perm_ok(perm) || !page_va_ok(va)
+	    || npages > (UTOP - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+	if (envid2env(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+
+	while (done < npages && r == 0) {
+		// Zero the pages before taking the env's lock
+		m = MIN(npages - done, PAGE_BATCH);
+		for (i = 0; i < m; i++)
+			if (!(pps[i] = page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM))) {
+				r = -E_NO_MEM;
+				break;
+			}
+		m = i;
+
+		if (envid2env_lock(envid, &e, 1) < 0) {
+			r = -E_BAD_ENV;
+			i = 0;
+		} else {
+			tlb_batch_begin(e->env_pgdir);
+			for (i = 0; i < m; i++)
+				if (page_insert(e->env_pgdir, pps[i],
+						(char *) va + (done + i) * PGSIZE, perm) < 0) {
+					r = -E_NO_MEM;
+					break;
+				}
+			tlb_batch_end();
+			env_unlock(e);
+		}
+		done += i;
+		for (; i < m; i++)
+			page_free(pps[i]);
+	}
+	return done > 0 ? done : r;
+}
+
+// Unmap the npages pages starting at va in envid, as npages calls to
+// sys_page_unmap would.
+//
+// Returns the number of pages unmapped, or < 0 on error.
+// Errors are as for sys_page_unmap.
+static int
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
+{
+	struct Env *e;
+	size_t i;
+
+	if (!page_va_ok(va) || npages > (UTOP - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+	if (envid2env_lock(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+	tlb_batch_begin(e->env_pgdir);
+	for (i = 0; i < npages; i++)
+		page_remove(e->env_pgdir, (char *) va + i * PGSIZE);
+	tlb_batch_end();
+	env_unlock(e);
+	return npages;
+}
+
+// Reserve [va, va+len) in envid as demand-zero memory.  Nothing is
+// allocated now: the first touch of each page in the range maps a
+// zeroed page with permission 'perm' (see page_anon_fault), so large
+// sparse regions cost only what is used.  Pages already mapped in the
+// range are left alone.  The region lasts as long as the environment
+// and is inherited by sys_fork.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned, len is 0, the range extends
+//		above UTOP, perm is inappropriate (see sys_page_alloc),
+//		or the range overlaps one of envid's demand-zero regions
+//		or its stack and the stack's guard gap.
+//	-E_NO_MEM if envid already has ENV_NANON demand-zero regions.
+static int
+sys_mmap_anon(envid_t envid, void *va, size_t len, int perm)
+{
+	struct Env *e;
+	struct AnonRegion *ar;
+	uintptr_t start = (uintptr_t) va, end;
+	int i, r = 0;
+
+	if (!page_perm_ok(perm) || !page_va_ok(va) || len == 0
+	    || len > UTOP - start)
+		return -E_INVAL;
+	end = start + ROUNDUP(len, PGSIZE);
+
+	if (envid2env_lock(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+	for (i = 0; i < e->env_nanon; i++)
+		if (start < e->env_anon[i].ar_end && e->env_anon[i].ar_start < end)
+			r = -E_INVAL;
+	if (end > e->env_stack_limit - USTACKGUARD && start < USTACKTOP)
+		r = -E_INVAL;
+	if (r == 0 && e->env_nanon == ENV_NANON)
+		r = -E_NO_MEM;
+	if (r == 0) {
+		ar = &e->env_anon[e->env_nanon++];
+		ar->ar_start = start;
+		ar->ar_end = end;
+		ar->ar_perm = perm;
+	}
+	env_unlock(e);
+	return r;
+}
+
+// Let envid's stack grow on demand to 'size' bytes below USTACKTOP.
+// The stack starts at USTACKSIZE.  Pages already mapped below a new,
+// smaller limit stay mapped.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if size is not a multiple of PGSIZE, is 0 or larger
+//		than USTACKMAX, or would put the stack or its guard gap
+//		over one of envid's demand-zero regions.
+static int
+sys_env_set_stack_limit(envid_t envid, size_t size)
+{
+	struct Env *e;
+	uintptr_t limit = USTACKTOP - size;
+	int i, r = 0;
+
+	if (size == 0 || size % PGSIZE || size > USTACKMAX)
+		return -E_INVAL;
+	if (envid2env_lock(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+	for (i = 0; i < e->env_nanon; i++)
+		if (e->env_anon[i].ar_end > limit - USTACKGUARD)
+			r = -E_INVAL;
+	if (r == 0)
+		e->env_stack_limit = limit;
+	env_unlock(e);
+	return r;
+}
+
+// Set envid's scheduling weight.  Among the environments runnable on
+// a CPU, each gets CPU time in proportion to its weight.  Environments
+// start with ENV_WEIGHT_DEFAULT, or their parent's weight if forked.
+// Only environments with I/O privilege may hand out a weight above
+// their own, or a child could outweigh every other environment.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid,
+//		or weight is above the caller's and it has no I/O privilege.
+//	-E_INVAL if weight is 0 or larger than ENV_WEIGHT_MAX.
+static int
+sys_env_set_priority(envid_t envid, uint32_t weight)
+{
+	struct Env *e;
+
+	if (weight == 0 || weight > ENV_WEIGHT_MAX)
+		return -E_INVAL;
+	if (weight > curenv->env_weight
+	    && (curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+		return -E_BAD_ENV;
+	if (envid2env_lock(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+	e->env_weight = weight;
+	e->env_stride = SCHED_STRIDE1 / weight;
+	env_unlock(e);
+	return 0;
+}
+
+// Restrict envid to the CPUs whose bits are set in 'mask'.  Bits for
+// CPUs that do not exist are ignored.  Children created by fork or
+// spawn inherit the mask.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if mask allows no existing CPU.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+	struct Env *e;
+	int r;
+
+	if (envid2env_lock(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+	r = sched_set_affinity(e, mask);
+	env_unlock(e);
+	return r;
+}
+
+// Return the rate of the TSC in kHz, so that programs can turn the
+// cycle counts they measure with read_tsc into time.
+static uint32_t
+sys_tsc_khz(void)
+{
+	return kclock_tsc_hz / 1000;
+}
+
+// Make the scheduler's time slices 'us' microseconds long.  The time
+// slice is system-wide, so only environments with I/O privilege, such
+// as the file system server, may change it.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller does not have I/O privilege.
+//	-E_INVAL if us is below SCHED_QUANTUM_MIN_US or above
+//		SCHED_QUANTUM_MAX_US.
+static int
+sys_sched_set_quantum(uint32_t us)
+{
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+		return -E_BAD_ENV;
+	return sched_set_quantum(us);
+}
+
+// Put envid in the deadline class: each time it becomes runnable, it
+// is guaranteed 'runtime' TSC cycles of CPU within 'deadline' cycles,
+// at most once every 'period' cycles.  Deadline environments run
+// ahead of all others, earliest deadline first.  A runtime of 0 puts
+// envid back in the best-effort class.  The deadline class's share of
+// the CPUs is system-wide, so only environments with I/O privilege may
+// use it.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid,
+//		or the caller does not have I/O privilege.
+//	-E_INVAL if runtime > deadline, deadline > period,
+//		or period < 1000.
+//	-E_NO_MEM if the deadline class cannot fit runtime / period
+//		more of a CPU, see SCHED_DL_BW_MAX.
+static int
+sys_env_set_deadline(envid_t envid, uint32_t runtime, uint32_t period,
+		     uint32_t deadline)
+{
+	struct Env *e;
+	int r;
+
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+		return -E_BAD_ENV;
+	if (envid2env_lock(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+	r = sched_set_deadline(e, runtime, period, deadline);
+	env_unlock(e);
+	return r;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
-// so that receiver gets a duplicate mapping of the same page.
+// so that receiver gets a duplicate mapping of the same page.  As in
+// sys_page_map, sending a copy-on-write page with PTE_W first gives
+// the caller its own writable copy, and the receiver shares that.
 //
 // The send fails with a return value of -E_IPC_NOT_RECV if the
 // target is not blocked, waiting for an IPC.
@@ -368,7 +860,7 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
 //		address space.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
-//		current environment's address space.
+//		current environment's address space and not copy-on-write.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
 static int
@@ -382,9 +874,9 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     if (res < 0)
         return -E_BAD_ENV;
 
-    if (!dstenv_store->env_ipc_recving || dstenv_store->env_ipc_from != 0)
-        return -E_IPC_NOT_RECV;
-
+    // Look up the page to send, and take a reference to it, before
+    // locking the receiver; see sys_page_map.
+    struct PageInfo *pp = NULL;
     if ((uintptr_t) srcva < UTOP) {
         if ((uintptr_t) srcva % PGSIZE > 0)
             return -E_INVAL;
@@ -396,17 +888,39 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
             return -E_INVAL;
 
         pte_t *pte_store = NULL;
-        struct PageInfo *pp = page_lookup(curenv->env_pgdir, srcva, &pte_store);
-        if ((uintptr_t) srcva < UTOP && !pp)
+        swap_in(curenv, srcva);
+        if (perm & PTE_W)
+            page_cow_fault(curenv, srcva);
+        env_lock(curenv);
+        pp = page_lookup(curenv->env_pgdir, srcva, &pte_store);
+        if (!pp || ((perm & PTE_W) && (*pte_store & PTE_W) == 0)) {
+            env_unlock(curenv);
             return -E_INVAL;
+        }
+        page_incref(pp);
+        env_unlock(curenv);
+    }
 
-        if ((perm & PTE_W) && (*pte_store & PTE_W) == 0)
-            return -E_INVAL;
+    // The receiver's lock makes the rendezvous atomic: only one sender
+    // can see env_ipc_recving set and deliver to it.
+    res = envid2env_lock(envid, &dstenv_store, 0);
+    if (res < 0) {
+        res = -E_BAD_ENV;
+        goto out;
+    }
+
+    if (!dstenv_store->env_ipc_recving || dstenv_store->env_ipc_from != 0) {
+        res = -E_IPC_NOT_RECV;
+        goto unlock;
+    }
 
+    if (pp) {
         void *dstva = dstenv_store->env_ipc_dstva;
         res = page_insert(dstenv_store->env_pgdir, pp, dstva, perm);
-        if (res < 0)
-            return -E_NO_MEM;
+        if (res < 0) {
+            res = -E_NO_MEM;
+            goto unlock;
+        }
     }
 
     dstenv_store->env_ipc_recving = 0;
@@ -415,9 +929,16 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     dstenv_store->env_ipc_perm = (uintptr_t) srcva < UTOP ? perm : 0;
     // here return value of paused sys_ipc_recv is set
     dstenv_store->env_tf.tf_regs.reg_eax = 0;
-    dstenv_store->env_status = ENV_RUNNABLE;
-
-	return 0;
+    // The receiver is often a server with a request to handle now
+    dstenv_store->env_ipc_boost = 1;
+    env_set_status(dstenv_store, ENV_RUNNABLE);
+
+unlock:
+    env_unlock(dstenv_store);
+out:
+    if (pp)
+        page_decref(pp);
+    return res;
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -440,10 +961,18 @@ sys_ipc_recv(void *dstva)
     if ((uintptr_t) dstva < UTOP && (uintptr_t) dstva % PGSIZE > 0)
         return -E_INVAL;
 
-    curenv->env_ipc_recving = 1;
-    curenv->env_ipc_dstva = dstva;
-    curenv->env_status = ENV_NOT_RUNNABLE;
-    curenv->env_ipc_from = 0;
+    // A sender may deliver, and another CPU run us, as soon as we
+    // drop our lock; env_set_status clears curenv before that.
+    struct Env *e = curenv;
+    env_lock(e);
+    e->env_ipc_recving = 1;
+    e->env_ipc_dstva = dstva;
+    e->env_ipc_from = 0;
+    // The return value if a sender does not set it, stored while we
+    // still own our trapframe; see sys_env_set_status.
+    e->env_tf.tf_regs.reg_eax = 0;
+    env_set_status(e, ENV_NOT_RUNNABLE);
+    env_unlock(e);
 
     sys_yield();
 
@@ -492,6 +1021,29 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
             return sys_ipc_recv((void *) a1);
         case SYS_env_set_trapframe:
             return sys_env_set_trapframe((envid_t) a1, (struct Trapframe *) a2);
+        case SYS_fork:
+            return sys_fork();
+        case SYS_page_map_batch:
+            return sys_page_map_batch((envid_t) a1, (envid_t) a2, (const struct PageMapEntry *) a3, (size_t) a4);
+        case SYS_page_alloc_range:
+            return sys_page_alloc_range((envid_t) a1, (void *) a2, (size_t) a3, (int) a4);
+        case SYS_page_unmap_range:
+            return sys_page_unmap_range((envid_t) a1, (void *) a2, (size_t) a3);
+        case SYS_mmap_anon:
+            return sys_mmap_anon((envid_t) a1, (void *) a2, (size_t) a3, (int) a4);
+        case SYS_env_set_stack_limit:
+            return sys_env_set_stack_limit((envid_t) a1, (size_t) a2);
+        case SYS_env_set_priority:
+            return sys_env_set_priority((envid_t) a1, (uint32_t) a2);
+        case SYS_tsc_khz:
+            return sys_tsc_khz();
+        case SYS_sched_set_quantum:
+            return sys_sched_set_quantum((uint32_t) a1);
+        case SYS_env_set_affinity:
+            return sys_env_set_affinity((envid_t) a1, (uint32_t) a2);
+        case SYS_env_set_deadline:
+            return sys_env_set_deadline((envid_t) a1, (uint32_t) a2,
+                                        (uint32_t) a3, (uint32_t) a4);
         case NSYSCALLS:
             return 0;
         default:
@@ -13,6 +13,7 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/swap.h>
 
 //static struct Taskstate ts;
 
@@ -147,6 +148,10 @@ trap_init(void)
     SETGATE(idt[IRQ_OFFSET + 14], 0, GD_KT, IRQ_14, 0);
     void IRQ_15();
     SETGATE(idt[IRQ_OFFSET + 15], 0, GD_KT, IRQ_15, 0);
+    void IRQ_TLB();
+    SETGATE(idt[IRQ_OFFSET + IRQ_TLBFLUSH], 0, GD_KT, IRQ_TLB, 0);
+    void IRQ_RESCHED_H();
+    SETGATE(idt[IRQ_OFFSET + IRQ_RESCHED], 0, GD_KT, IRQ_RESCHED_H, 0);
 
 	// Per-CPU setup
 	trap_init_percpu();
@@ -168,7 +173,7 @@ trap_init_percpu(void)
 	//     thiscpu->cpu_id;
 	//   - Use "thiscpu->cpu_ts" as the TSS for the current CPU,
 	//     rather than the global "ts" variable;
-	//   - Use gdt[(GD_TSS0 >> 3) + i] for CPU i's TSS descriptor;
+	//   - Use gdt[(GD_TSS0 >> 3) + (i << 1)] for CPU i's TSS descriptor;
 	//   - You mapped the per-CPU kernel stacks in mem_init_mp()
 	//   - Initialize cpu_ts.ts_iomb to prevent unauthorized environments
 	//     from doing IO (0 is not the correct value!)
@@ -188,13 +193,13 @@ trap_init_percpu(void)
     thiscpu->cpu_ts.ts_iomb = sizeof(struct Taskstate);
 
 	// Initialize the TSS slot of the gdt.
-    gdt[(GD_TSS0 >> 3) + thiscpu->cpu_id] = SEG16(STS_T32A, (uint32_t) (&thiscpu->cpu_ts),
+    gdt[(GD_TSS0 >> 3) + (thiscpu->cpu_id << 1)] = SEG16(STS_T32A, (uint32_t) (&thiscpu->cpu_ts),
 					sizeof(struct Taskstate) - 1, 0);
-    gdt[(GD_TSS0 >> 3) + thiscpu->cpu_id].sd_s = 0;
+    gdt[(GD_TSS0 >> 3) + (thiscpu->cpu_id << 1)].sd_s = 0;
 
 	// Load the TSS selector (like other segment selectors, the
 	// bottom three bits are special; we leave them 0)
-	ltr(GD_TSS0 + (thiscpu->cpu_id << 3));
+	ltr(GD_TSS0 + (thiscpu->cpu_id << 4));
 
 	// Load the IDT
 	lidt(&idt_pd);
@@ -267,6 +272,16 @@ trap_dispatch(struct Trapframe *tf)
             lapic_eoi();
             sched_yield();
             return;
+        // A deadline environment became runnable, see sched_kick.
+        case (IRQ_OFFSET + IRQ_RESCHED):
+            lapic_eoi();
+            sched_yield();
+            return;
+        // Another CPU changed a mapping we may have cached.
+        case (IRQ_OFFSET + IRQ_TLBFLUSH):
+            tlb_shootdown_poll();
+            lapic_eoi();
+            return;
         // Handle keyboard and serial interrupts.
         // LAB 5: Your code here.
         case (IRQ_OFFSET+IRQ_KBD):
@@ -297,7 +312,12 @@ trap_dispatch(struct Trapframe *tf)
                     tf_regs->reg_edi,
                     tf_regs->reg_esi
             );
-            tf_regs->reg_eax = res;
+            // If the call blocked or yielded us, another CPU may be
+            // running us already; the syscall stored the return value
+            // while it still held our lock.
+            if (curenv && tf == &curenv->env_tf
+                && curenv->env_status == ENV_RUNNING)
+                tf_regs->reg_eax = res;
             return;
         }
         default:
@@ -306,6 +326,7 @@ trap_dispatch(struct Trapframe *tf)
             if (tf->tf_cs == GD_KT)
                 panic("unhandled trap in kernel");
             else {
+                env_lock(curenv);
                 env_destroy(curenv);
                 return;
             }
@@ -324,10 +345,9 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// Note that we are no longer halted in sched_yield()
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
+
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -335,17 +355,20 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-        lock_kernel();
-
-		assert(curenv);
-
-		// Garbage collect if current enviroment is a zombie
-		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
+		// There is no big kernel lock: each kernel subsystem
+		// takes its own locks (see env_lock and page_lock).
+		struct Env *e = curenv;
+
+		assert(e);
+
+		// Garbage collect if current enviroment is a zombie.
+		// Only this CPU can move curenv out of ENV_DYING, so
+		// the unlocked check is safe.
+		if (e->env_status == ENV_DYING) {
+			env_lock(e);
+			env_free(e);
 			curenv = NULL;
+			env_unlock(e);
 			sched_yield();
 		}
 
@@ -377,6 +400,7 @@ trap(struct Trapframe *tf)
 void
 page_fault_handler(struct Trapframe *tf)
 {
+	extern char user_copy_insn[], user_copy_fault[];
 	uint32_t fault_va;
 
 	// Read processor's CR2 register to find the faulting address
@@ -385,12 +409,44 @@ page_fault_handler(struct Trapframe *tf)
 	// Handle kernel-mode page faults.
 
 	// LAB 3: Your code here.
-	if ((tf->tf_cs & 3) == 0)
+	if ((tf->tf_cs & 3) == 0) {
+	    // The kernel may touch user memory that went to swap after
+	    // user_mem_check looked at it.  Bring it back and carry on.
+	    if (curenv && fault_va < UTOP && !(tf->tf_err & FEC_PR)
+	        && (swap_in(curenv, (void *) fault_va) == 0
+	            || page_anon_fault(curenv, (void *) fault_va) == 0))
+	        env_pop_tf(tf);
+	    // With CR0_WP on, kernel writes honor copy-on-write too, and
+	    // page merging can make any user page copy-on-write.
+	    if (curenv && fault_va < UTOP && (tf->tf_err & FEC_WR)
+	        && page_cow_fault(curenv, (void *) fault_va) == 0)
+	        env_pop_tf(tf);
+	    // Anything else user_copy touches is really gone; make the
+	    // copy fail rather than the kernel.
+	    if (curenv && tf->tf_eip == (uintptr_t) user_copy_insn) {
+	        tf->tf_eip = (uintptr_t) user_copy_fault;
+	        env_pop_tf(tf);
+	    }
 	    panic("kernel fault va %08x\n", fault_va);
+	}
 
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// The first touch of a page in a demand-zero region, including
+	// a growing stack, maps a zeroed page without bothering the
+	// environment, and so does touching a page that is in swap.
+	if (!(tf->tf_err & FEC_PR)
+	    && (swap_in(curenv, (void *) fault_va) == 0
+		|| page_anon_fault(curenv, (void *) fault_va) == 0))
+		return;
+
+	// Copy-on-write faults are resolved right here, which saves the
+	// upcall and the three system calls lib/fork.c's pgfault makes.
+	// Only other faults go to the environment's upcall.
+	if ((tf->tf_err & FEC_WR) && page_cow_fault(curenv, (void *) fault_va) == 0)
+		return;
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -421,7 +477,7 @@ page_fault_handler(struct Trapframe *tf)
 	//   (the 'tf' variable points at 'curenv->env_tf').
 
 	// LAB 4: Your code here.
-    struct UTrapframe *utf;
+    struct UTrapframe *utf, kutf;
 
     if (curenv->env_pgfault_upcall) {
         if (tf->tf_esp < UXSTACKTOP && tf->tf_esp >= UXSTACKTOP - PGSIZE) {
@@ -432,12 +488,16 @@ page_fault_handler(struct Trapframe *tf)
 //        cprintf("page_fault_handler: env %08x enter user_mem_assert\n", curenv->env_id);
         user_mem_assert(curenv, (const void *) utf, sizeof(struct UTrapframe), PTE_W | PTE_P);
 
-        utf->utf_fault_va = fault_va;
-        utf->utf_err      = tf->tf_trapno;
-        utf->utf_regs     = tf->tf_regs;
-        utf->utf_eflags   = tf->tf_eflags;
-        utf->utf_eip      = tf->tf_eip;
-        utf->utf_esp      = tf->tf_esp;
+        kutf.utf_fault_va = fault_va;
+        kutf.utf_err      = tf->tf_trapno;
+        kutf.utf_regs     = tf->tf_regs;
+        kutf.utf_eflags   = tf->tf_eflags;
+        kutf.utf_eip      = tf->tf_eip;
+        kutf.utf_esp      = tf->tf_esp;
+        // Another CPU may have unmapped the exception stack since
+        // user_mem_assert looked at it.
+        if (user_mem_copyout(utf, &kutf, sizeof(kutf)) < 0)
+            goto destroy;
 
         curenv->env_tf.tf_eip = (uintptr_t) curenv->env_pgfault_upcall;
         curenv->env_tf.tf_esp = (uintptr_t) utf;
@@ -446,10 +506,12 @@ page_fault_handler(struct Trapframe *tf)
         env_run(curenv);
     }
 
+destroy:
 	// Destroy the environment that caused the fault.
 	cprintf("[%08x] user fault va %08x ip %08x\n",
 		curenv->env_id, fault_va, tf->tf_eip);
 	print_trapframe(tf);
+	env_lock(curenv);
 	env_destroy(curenv);
 }
 
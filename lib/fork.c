@@ -3,9 +3,8 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
+// PTE_COW, defined in inc/mmu.h, marks copy-on-write page table entries.
 // It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
 
 // Assembly language pgfault entrypoint defined in lib/pfentry.S.
 extern void _pgfault_upcall(void);
@@ -127,37 +126,27 @@ duppage(envid_t envid, unsigned pn)
 	return 0;
 }
 
-// User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Fork with copy-on-write.
+// Set up our page fault handler appropriately, then let the kernel
+// create the child: sys_fork copies our page tables, marking writable
+// pages copy-on-write in both of us (PTE_SHARE pages stay shared, as
+// duppage does), gives the child a fresh user exception stack and our
+// page fault upcall, and marks it runnable.  This costs one system
+// call instead of two per page.
 //
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
 // It is also OK to panic on error.
 //
-// Hint:
-//   Use uvpd, uvpt, and duppage.
-//   Remember to fix "thisenv" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
-//
 envid_t
 fork(void)
 {
-	// LAB 4: Your code here.
-//	panic("fork not implemented");
-
     envid_t envid;
-    uint8_t *addr;
-    int r;
 
     set_pgfault_handler(pgfault);
-    // sys_exofork is a user-level system call
-    envid = sys_exofork();
+    envid = sys_fork();
 
     if (envid < 0)
-        panic("sys_exofork: %e", envid);
+        panic("sys_fork: %e", envid);
     if (envid == 0) {
         // We're the child.
         // The copied value of the global variable 'thisenv'
@@ -167,31 +156,12 @@ fork(void)
         return 0;
     }
 
-    // We're the parent.
-
-    // Copy parent address space to child
-    for (int i = 0; i < PGNUM(USTACKTOP); i++) {
-        if ((uvpd[PDX(i * PGSIZE)] & PTE_P) && (uvpt[i] & PTE_P)) {
-            if ((r = duppage(envid, i)) < 0)
-                panic("fork: duppage: %e", r);
-        }
-    }
-
-    // page fault handler setup in child, alloc user exception stack space first
-    if ((r = sys_page_alloc(envid, (void *) (UXSTACKTOP - PGSIZE), PTE_SYSCALL)) < 0)
-        panic("fork: sys_page_alloc: %e", r);
-
-    // page fault handler setup in child, set page fault upcall second
-    if ((r = sys_env_set_pgfault_upcall(envid, _pgfault_upcall)) < 0)
-        panic("fork: sys_env_set_pgfault_upcall: %e", r);
-
-    // Start the child environment running
-    if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
-        panic("fork: sys_env_set_status: %e", r);
-
     return envid;
 }
 
+// Pages sfork shares with the child per system call
+#define SFORK_BATCH	32
+
 // Challenge!
 int
 sfork(void)
@@ -219,17 +189,20 @@ sfork(void)
 
     // We're the parent.
 
-    // Copy parent address space to child
-    int i;
+    // Share parent address space with child, SFORK_BATCH pages per
+    // system call
+    struct PageMapEntry ents[SFORK_BATCH];
+    int i, n = 0;
     for (i = 0; i < PGNUM(USTACKTOP) - 1; i++) {
         if ((uvpd[PDX(i * PGSIZE)] & PTE_P) && (uvpt[i] & PTE_P) && (uvpt[i] & PTE_U)) {
-            void *addr = (void *) (i * PGSIZE);
-            if ((r = sys_page_map(thisenv->env_id, addr, envid, addr, PTE_P | PTE_U | PTE_W)) < 0) {
-                panic("sys_page_map: %e", r);
-            }
-            if ((r = sys_page_map(thisenv->env_id, addr, thisenv->env_id, addr, PTE_P | PTE_U | PTE_W)) < 0) {
-                panic("sys_page_map: %e", r);
-            }
+            ents[n].pme_srcva = ents[n].pme_dstva = (void *) (i * PGSIZE);
+            ents[n].pme_perm = PTE_P | PTE_U | PTE_W;
+            n++;
+        }
+        if (n == SFORK_BATCH || (n > 0 && i == PGNUM(USTACKTOP) - 2)) {
+            if ((r = sys_page_map_batch(0, envid, ents, n)) != n)
+                panic("sys_page_map_batch: %e", r);
+            n = 0;
         }
     }
 
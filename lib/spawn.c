@@ -5,6 +5,9 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Pages map_segment and copy_shared_pages hand to one system call
+#define SPAWN_BATCH		32
+
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
@@ -364,8 +367,8 @@ static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
-	void *blk;
+	struct PageMapEntry ents[SPAWN_BATCH];
+	int i, j, n, r;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -376,23 +379,38 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+	// Read the file-backed pages in batches at UTEMP, then move each
+	// batch into the child
+	for (i = 0; i < filesz; i += n * PGSIZE) {
+		n = MIN(ROUNDUP(filesz - i, PGSIZE) / PGSIZE, SPAWN_BATCH);
+		if ((r = sys_page_alloc_range(0, UTEMP, n, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		if (r < n)
+			return -E_NO_MEM;
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			return r;
+		if ((r = readn(fd, UTEMP, MIN(n * PGSIZE, filesz - i))) < 0)
+			return r;
+		for (j = 0; j < n; j++) {
+			ents[j].pme_srcva = UTEMP + j * PGSIZE;
+			ents[j].pme_dstva = (void*) (va + i + j * PGSIZE);
+			ents[j].pme_perm = perm;
 		}
+		if ((r = sys_page_map_batch(0, child, ents, n)) != n)
+			panic("spawn: sys_page_map_batch data: %e", r);
+		sys_page_unmap_range(0, UTEMP, n);
+	}
+
+	// The rest is demand-zero, or blank pages allocated now if the
+	// child is out of demand-zero regions
+	if (i < memsz) {
+		n = ROUNDUP(memsz - i, PGSIZE) / PGSIZE;
+		if (sys_mmap_anon(child, (void*) (va + i), n * PGSIZE, perm) == 0)
+			return 0;
+		if ((r = sys_page_alloc_range(child, (void*) (va + i), n, perm)) < 0)
+			return r;
+		if (r < n)
+			return -E_NO_MEM;
 	}
 	return 0;
 }
@@ -403,15 +421,23 @@ copy_shared_pages(envid_t child)
 {
 	// LAB 5: Your code here.
 
-	int r;
+	struct PageMapEntry ents[SPAWN_BATCH];
+	int r, n = 0;
 
     for (int i = 0; i < PGNUM(USTACKTOP); i++) {
         if ((uvpd[PDX(i * PGSIZE)] & PTE_P) && (uvpt[i] & PTE_P)) {
             if (uvpt[i] & PTE_SHARE) {
-                if ((r = sys_page_map(thisenv->env_id, (void *) (i * PGSIZE), child, (void *) (i * PGSIZE), uvpt[i] & PTE_SYSCALL)) < 0)
-                    panic("spawn: copy_shared_pages: %e", r);
+                ents[n].pme_srcva = ents[n].pme_dstva = (void *) (i * PGSIZE);
+                ents[n].pme_perm = uvpt[i] & PTE_SYSCALL;
+                n++;
             }
         }
+        // Map the shared pages SPAWN_BATCH at a time
+        if (n == SPAWN_BATCH || (n > 0 && i == PGNUM(USTACKTOP) - 1)) {
+            if ((r = sys_page_map_batch(0, child, ents, n)) != n)
+                panic("spawn: copy_shared_pages: %e", r);
+            n = 0;
+        }
     }
 
 	return 0;
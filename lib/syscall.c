@@ -87,6 +87,12 @@ sys_page_unmap(envid_t envid, void *va)
 
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -117,3 +123,66 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_page_map_batch(envid_t srcenv, envid_t dstenv,
+		   const struct PageMapEntry *ents, size_t n)
+{
+	return syscall(SYS_page_map_batch, 0, srcenv, dstenv, (uint32_t) ents, n, 0);
+}
+
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	return syscall(SYS_page_alloc_range, 0, envid, (uint32_t) va, npages, perm, 0);
+}
+
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
+{
+	return syscall(SYS_page_unmap_range, 0, envid, (uint32_t) va, npages, 0, 0);
+}
+
+int
+sys_mmap_anon(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_mmap_anon, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_env_set_stack_limit(envid_t envid, size_t size)
+{
+	return syscall(SYS_env_set_stack_limit, 1, envid, size, 0, 0, 0);
+}
+
+int
+sys_env_set_priority(envid_t envid, uint32_t weight)
+{
+	return syscall(SYS_env_set_priority, 1, envid, weight, 0, 0, 0);
+}
+
+int
+sys_env_set_deadline(envid_t envid, uint32_t runtime, uint32_t period,
+		     uint32_t deadline)
+{
+	return syscall(SYS_env_set_deadline, 1, envid, runtime, period,
+		       deadline, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, mask, 0, 0, 0);
+}
+
+uint32_t
+sys_tsc_khz(void)
+{
+	return syscall(SYS_tsc_khz, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_sched_set_quantum(uint32_t us)
+{
+	return syscall(SYS_sched_set_quantum, 1, us, 0, 0, 0, 0);
+}
+
@@ -0,0 +1,40 @@
+// Measure the cost of a context switch between two address spaces.
+// Parent and child bounce an IPC back and forth, so every round trip
+// is two env_runs, each reloading CR3.  With global kernel pages
+// (CR4_PGE) those reloads keep the kernel's TLB entries.
+// Run with "make run-ctxbench", or ./bench-ctxsw to compare against
+// a CPU without PGE.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS		10000
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint64_t start, end;
+	uint32_t i;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		while ((i = ipc_recv(&who, NULL, NULL)) < NROUNDS - 1)
+			ipc_send(who, i, NULL, 0);
+		ipc_send(who, i, NULL, 0);
+		return;
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++) {
+		ipc_send(who, i, NULL, 0);
+		if (ipc_recv(NULL, NULL, NULL) != i)
+			panic("ctxbench: bad reply");
+	}
+	end = read_tsc();
+
+	cprintf("ctxbench: %d round trips in %u kcycles\n",
+		NROUNDS, (uint32_t) ((end - start) / 1000));
+	cprintf("ctxbench: done\n");
+}
@@ -0,0 +1,111 @@
+// Measure wakeup-to-run latency of the deadline class under load.
+// Run with CPUS=1 TEST_TYPE=ENV_TYPE_PRIV, since setting deadlines
+// takes I/O privilege.
+//
+// A waiter blocks in ipc_recv while NHOGS CPU hogs and we keep the CPU
+// busy.  Every so often we send it the current TSC, and it works out
+// how long it took from the send to when it ran.  As a best-effort env
+// the waiter runs only once we give up the CPU; in the deadline class
+// it should run right away.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NHOGS		4
+#define NWAKES		50
+#define SPIN_CYCLES	(2 * 1000 * 1000)
+
+// 10% of the CPU, within 2M cycles of waking up
+#define DL_RUNTIME	(1000 * 1000)
+#define DL_PERIOD	(10 * 1000 * 1000)
+#define DL_DEADLINE	(2 * 1000 * 1000)
+
+static void
+spin(uint32_t cycles)
+{
+	uint64_t end = read_tsc() + cycles;
+
+	while (read_tsc() < end)
+		/* do nothing */;
+}
+
+// Fork a child that receives NWAKES timestamps and then sends us the
+// average and the largest latency it saw.
+static envid_t
+waiter(void)
+{
+	envid_t who;
+	uint32_t lat, max = 0;
+	uint64_t sum = 0;
+	int i;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		for (i = 0; i < NWAKES; i++) {
+			lat = (uint32_t) read_tsc() - ipc_recv(0, 0, 0);
+			sum += lat;
+			if (lat > max)
+				max = lat;
+		}
+		ipc_send(thisenv->env_parent_id, sum / NWAKES, 0, 0);
+		ipc_send(thisenv->env_parent_id, max, 0, 0);
+		exit();
+	}
+	return who;
+}
+
+// Wake 'who' NWAKES times and print the latencies it reports.
+static void
+measure(envid_t who, const char *class)
+{
+	uint32_t avg, max, khz = sys_tsc_khz();
+	int i, r;
+
+	for (i = 0; i < NWAKES; i++) {
+		spin(SPIN_CYCLES);
+		// Take the timestamp on each try, so time spent waiting
+		// for the waiter to block again does not count.
+		while ((r = sys_ipc_try_send(who, (uint32_t) read_tsc(), 0, 0))
+		       == -E_IPC_NOT_RECV)
+			sys_yield();
+		if (r < 0)
+			panic("sys_ipc_try_send: %e", r);
+	}
+	avg = ipc_recv(0, 0, 0);
+	max = ipc_recv(0, 0, 0);
+	cprintf("dltest: %s wakeup latency avg %u max %u us\n",
+		class, (uint32_t) ((uint64_t) avg * 1000 / khz),
+		(uint32_t) ((uint64_t) max * 1000 / khz));
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who, hogs[NHOGS];
+	int i, r;
+
+	for (i = 0; i < NHOGS; i++) {
+		if ((hogs[i] = fork()) < 0)
+			panic("fork: %e", hogs[i]);
+		if (hogs[i] == 0)
+			while (1)
+				/* do nothing */;
+	}
+
+	measure(waiter(), "best-effort");
+
+	who = waiter();
+	if ((r = sys_env_set_deadline(who, DL_RUNTIME, DL_PERIOD, DL_DEADLINE)) < 0)
+		panic("sys_env_set_deadline: %e", r);
+	// Admission control must turn away a second env that would
+	// overcommit the CPU.
+	r = sys_env_set_deadline(hogs[0], 9 * DL_PERIOD / 10, DL_PERIOD, DL_PERIOD);
+	if (r != -E_NO_MEM)
+		panic("overcommitted deadline class admitted: %e", r);
+	measure(who, "deadline");
+
+	for (i = 0; i < NHOGS; i++)
+		sys_env_destroy(hogs[i]);
+	cprintf("dltest: done\n");
+}
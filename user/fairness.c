@@ -1,25 +1,98 @@
-// Demonstrate lack of fairness in IPC.
-// Start three instances of this program as envs 1, 2, and 3.
-// (user/idle is env 0).
+// Measure how fairly the scheduler shares the CPU.  Run with CPUS=1.
+//
+// Two counters with weights 1:3 spin for the same stretch of time and
+// should count to about 1:3.  Then we time file reads, which wait on
+// the FS server, with no CPU hogs and with NHOGS of them runnable:
+// the FS server is boosted when a request arrives, so the reads should
+// take about as long either way.
 
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+#define COUNT_CYCLES	(1000ULL * 1000 * 1000)
+#define NHOGS		4
+#define NREADS		20
+// Weight 3 must count between 3 - 3 / TOLERANCE and 3 + 3 / TOLERANCE
+// times as much as weight 1.
+#define TOLERANCE	5
+
+// Fork a child of the given weight that counts until 'end' and sends
+// the count to us.
+static envid_t
+counter(uint32_t weight, uint64_t end)
+{
+	envid_t who;
+	uint32_t n = 0;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		while (read_tsc() < end)
+			n++;
+		ipc_send(thisenv->env_parent_id, n, 0, 0);
+		exit();
+	}
+	sys_env_set_priority(who, weight);
+	return who;
+}
+
+// Return the average cycles it takes to open, read and close a file.
+static uint32_t
+read_cycles(void)
+{
+	char buf[512];
+	uint64_t start;
+	int i, fd, r;
+
+	start = read_tsc();
+	for (i = 0; i < NREADS; i++) {
+		if ((fd = open("/newmotd", O_RDONLY)) < 0)
+			panic("open /newmotd: %e", fd);
+		if ((r = readn(fd, buf, sizeof(buf))) < 0)
+			panic("read /newmotd: %e", r);
+		close(fd);
+	}
+	return (read_tsc() - start) / NREADS;
+}
 
 void
 umain(int argc, char **argv)
 {
-	envid_t who, id;
-
-	id = sys_getenvid();
-
-	if (thisenv == &envs[1]) {
-		while (1) {
-			ipc_recv(&who, 0, 0);
-			cprintf("%x recv from %x\n", id, who);
-		}
-	} else {
-		cprintf("%x loop sending to %x\n", id, envs[1].env_id);
-		while (1)
-			ipc_send(envs[1].env_id, 0, 0, 0);
+	envid_t lo, hi, who, hogs[NHOGS];
+	uint32_t n, nlo = 0, nhi = 0, pct, idle, busy;
+	uint64_t end;
+	int i;
+
+	end = read_tsc() + COUNT_CYCLES;
+	lo = counter(ENV_WEIGHT_DEFAULT, end);
+	hi = counter(3 * ENV_WEIGHT_DEFAULT, end);
+	for (i = 0; i < 2; i++) {
+		n = ipc_recv(&who, 0, 0);
+		if (who == lo)
+			nlo = n;
+		else if (who == hi)
+			nhi = n;
 	}
-}
+	pct = nlo ? (uint64_t) nhi * 100 / nlo : 0;
+	cprintf("fairness: weight 1 counted %u, weight 3 counted %u (%u%%)\n",
+		nlo, nhi, pct);
+	if (pct < 300 - 300 / TOLERANCE || pct > 300 + 300 / TOLERANCE)
+		panic("weight 3 got %u%% of weight 1's share, not about 300%%",
+		      pct);
+
+	idle = read_cycles();
+	for (i = 0; i < NHOGS; i++) {
+		if ((hogs[i] = fork()) < 0)
+			panic("fork: %e", hogs[i]);
+		if (hogs[i] == 0)
+			while (1)
+				/* do nothing */;
+	}
+	busy = read_cycles();
+	for (i = 0; i < NHOGS; i++)
+		sys_env_destroy(hogs[i]);
 
+	cprintf("fairness: file read %u kcycles idle, %u kcycles with %d hogs\n",
+		idle / 1000, busy / 1000, NHOGS);
+	cprintf("fairness: done\n");
+}
@@ -0,0 +1,40 @@
+// Measure how long fork takes for a process with many mapped pages.
+// The kernel's sys_fork copies the page tables in one system call;
+// the old user-level fork made two sys_page_map calls per page.
+// Run with "make run-forkbench".
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES		1024
+#define NFORKS		16
+
+static char *region = (char *) 0x10000000;
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint64_t start, cycles = 0;
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++) {
+		if ((r = sys_page_alloc(0, region + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		region[i * PGSIZE] = i;
+	}
+
+	for (i = 0; i < NFORKS; i++) {
+		start = read_tsc();
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0)
+			return;
+		cycles += read_tsc() - start;
+		wait(who);
+	}
+
+	cprintf("forkbench: %d forks of %d pages in %u kcycles\n",
+		NFORKS, NPAGES, (uint32_t) (cycles / 1000));
+	cprintf("forkbench: done\n");
+}
@@ -0,0 +1,38 @@
+// Test same-page merging: fill many pages with the same bytes, give an
+// idle CPU time to merge them, then check that writes to one page do
+// not show through the others.  Run with CPUS=2 so that one CPU idles.
+
+#include <inc/lib.h>
+
+#define REGION		((char *) 0x10000000)
+#define NPAGES		64
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++) {
+		if ((r = sys_page_alloc(0, REGION + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		memset(REGION + i * PGSIZE, 0x5a, PGSIZE);
+	}
+
+	// The scanner needs two sweeps to trust a page, and a third to
+	// merge the others into it.
+	for (i = 0; i < 20000; i++)
+		sys_yield();
+
+	for (i = 0; i < NPAGES; i++)
+		REGION[i * PGSIZE] = i;
+	for (i = 0; i < NPAGES; i++)
+		if (REGION[i * PGSIZE] != i || REGION[i * PGSIZE + 1] != 0x5a)
+			panic("page at %p has the wrong contents", REGION + i * PGSIZE);
+
+	// The fs IPC buffer may have been merged too; it must still work
+	if ((r = open("/newmotd", O_RDONLY)) < 0)
+		panic("open /newmotd: %e", r);
+	close(r);
+
+	cprintf("mergetest: OK\n");
+}
@@ -0,0 +1,61 @@
+// Test CPU affinity: children pinned to one CPU each must only ever run
+// there, and a pinned env's children must inherit its mask.  Run with
+// CPUS=2 or more.
+
+#include <inc/lib.h>
+
+#define NYIELDS		2000
+
+// Fork a child pinned to 'mask' that yields NYIELDS times, checking
+// where it runs, then forks a grandchild that checks the same.
+static envid_t
+pinned(uint32_t mask)
+{
+	envid_t who;
+	int i, r;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		// Wait until our parent has pinned us
+		while (thisenv->env_affinity != mask)
+			sys_yield();
+		for (i = 0; i < NYIELDS; i++) {
+			if (!(mask & (1 << thisenv->env_cpunum)))
+				panic("env %08x pinned to %x ran on CPU %d",
+				      thisenv->env_id, mask, thisenv->env_cpunum);
+			sys_yield();
+		}
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0 && thisenv->env_affinity != mask)
+			panic("child did not inherit affinity %x", mask);
+		if (r == 0 && !(mask & (1 << thisenv->env_cpunum)))
+			panic("child of env pinned to %x ran on CPU %d",
+			      mask, thisenv->env_cpunum);
+		exit();
+	}
+	if ((r = sys_env_set_affinity(who, mask)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+	return who;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int ncpu, i;
+
+	// Masks that allow only missing CPUs are refused
+	for (ncpu = 0; ncpu < 32; ncpu++)
+		if (sys_env_set_affinity(0, 1 << ncpu) < 0)
+			break;
+	sys_env_set_affinity(0, ENV_AFFINITY_ALL);
+	cprintf("pintest: %d CPUs\n", ncpu);
+
+	for (i = 0; i < ncpu; i++)
+		pinned(1 << i);
+	pinned(ENV_AFFINITY_ALL & ~1);
+	for (i = 0; i < NYIELDS; i++)
+		sys_yield();
+	cprintf("pintest: done\n");
+}
@@ -0,0 +1,55 @@
+// Measure how system call throughput scales with the number of CPUs.
+// Each worker allocates and unmaps a page in its own address space
+// over and over; these syscalls touch no shared state except the page
+// allocator, so they should run in parallel on different CPUs.
+// Run with "make run-scalebench CPUS=n", or ./bench-scale for n = 1..8.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NWORKERS	8
+#define NITER		2000
+
+static void
+worker(void)
+{
+	int i, r;
+	char *va = (char *) UTEMP;
+
+	// Wait for the go signal, so that all workers start together
+	ipc_recv(NULL, NULL, NULL);
+	for (i = 0; i < NITER; i++) {
+		if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("sys_page_unmap: %e", r);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who[NWORKERS];
+	uint64_t start, end;
+	int i;
+
+	for (i = 0; i < NWORKERS; i++) {
+		if ((who[i] = fork()) < 0)
+			panic("fork: %e", who[i]);
+		if (who[i] == 0) {
+			worker();
+			return;
+		}
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NWORKERS; i++)
+		ipc_send(who[i], 0, NULL, 0);
+	for (i = 0; i < NWORKERS; i++)
+		wait(who[i]);
+	end = read_tsc();
+
+	cprintf("scalebench: %d ops in %u kcycles\n",
+		NWORKERS * NITER * 2, (uint32_t) ((end - start) / 1000));
+	cprintf("scalebench: done\n");
+}
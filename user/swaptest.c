@@ -0,0 +1,40 @@
+// Test paging to swap: touch more memory than the machine has, then
+// check that every page still holds what was written to it.
+// Run with QEMUEXTRA="-m 32" (see bench-swap).
+
+#include <inc/lib.h>
+
+#define REGION		((char *) 0x10000000)
+#define REGIONSIZE	(48 * 1024 * 1024)
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int i, r, pass;
+
+	if ((r = sys_mmap_anon(0, REGION, REGIONSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_mmap_anon: %e", r);
+
+	for (i = 0; i < REGIONSIZE; i += PGSIZE)
+		*(int *) (REGION + i) = i;
+
+	// Read everything back twice, so pages go out and come in again
+	for (pass = 0; pass < 2; pass++)
+		for (i = 0; i < REGIONSIZE; i += PGSIZE)
+			if (*(int *) (REGION + i) != i)
+				panic("page at %p lost its contents", REGION + i);
+
+	// A child shares the swapped-out pages until either side writes
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		for (i = 0; i < REGIONSIZE; i += 64 * PGSIZE)
+			if (*(int *) (REGION + i) != i)
+				panic("child: page at %p lost its contents", REGION + i);
+		return;
+	}
+	wait(who);
+
+	cprintf("swaptest: OK\n");
+}
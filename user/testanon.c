@@ -0,0 +1,59 @@
+// Test demand-zero memory from sys_mmap_anon.
+
+#include <inc/lib.h>
+
+#define REGION		((char *) 0x20000000)
+#define REGIONSIZE	(64 * 1024 * 1024)
+#define STRIDE		(256 * PGSIZE)
+
+static bool
+mapped(void *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int i, r, n = 0;
+
+	if ((r = sys_mmap_anon(0, REGION, REGIONSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_mmap_anon: %e", r);
+	if ((r = sys_mmap_anon(0, REGION + PGSIZE, PGSIZE, PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("overlapping sys_mmap_anon returned %e", r);
+
+	// Nothing is mapped until it is touched, and then it reads as zero
+	for (i = 0; i < REGIONSIZE; i += STRIDE) {
+		if (mapped(REGION + i))
+			panic("page at %p mapped before use", REGION + i);
+		if (REGION[i] != 0)
+			panic("page at %p not zeroed", REGION + i);
+		REGION[i + 1] = i / STRIDE;
+	}
+	for (i = 0; i < REGIONSIZE; i += PGSIZE)
+		n += mapped(REGION + i);
+	if (n != REGIONSIZE / STRIDE)
+		panic("%d pages mapped, expected %d", n, REGIONSIZE / STRIDE);
+
+	// The kernel fills in untouched pages that we pass to it
+	sys_cputs(REGION + PGSIZE, 1);
+	if (!mapped(REGION + PGSIZE))
+		panic("sys_cputs did not fill in %p", REGION + PGSIZE);
+
+	// A child inherits both the pages and the region
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		for (i = 0; i < REGIONSIZE; i += STRIDE)
+			if (REGION[i + 1] != i / STRIDE)
+				panic("child lost the value at %p", REGION + i + 1);
+		REGION[2 * PGSIZE] = 1;
+		return;
+	}
+	wait(who);
+	if (REGION[2 * PGSIZE] != 0)
+		panic("child's write reached the parent");
+
+	cprintf("testanon: OK\n");
+}
@@ -0,0 +1,85 @@
+// Test mapping copy-on-write pages writable with sys_page_map,
+// sys_page_map_batch and sys_ipc_try_send.  The source's copy-on-write
+// is broken first, so the new mapping shares the source's private
+// copy and never the page other mappings still see.
+
+#include <inc/lib.h>
+
+#define A	((char *) 0x20000000)
+#define B	(A + PGSIZE)
+#define C	(A + 2 * PGSIZE)
+#define D	(A + 3 * PGSIZE)
+#define RECV	((char *) 0x30000000)
+
+// Map a fresh page at A holding 'v', copy-on-write shared with B.
+static void
+cow_pair(char v)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, A, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	*A = v;
+	if ((r = sys_page_map(0, A, 0, B, PTE_P|PTE_U|PTE_COW)) < 0
+	    || (r = sys_page_map(0, A, 0, A, PTE_P|PTE_U|PTE_COW)) < 0)
+		panic("sys_page_map: %e", r);
+}
+
+// Check that A and C share a page and B kept the old contents.
+static void
+check_broken(const char *what, char v)
+{
+	if (!(uvpt[PGNUM(A)] & PTE_W) || (uvpt[PGNUM(A)] & PTE_COW))
+		panic("%s left A copy-on-write", what);
+	*C = v + 1;
+	if (*A != v + 1)
+		panic("%s: A and C do not share a page", what);
+	if (*B != v)
+		panic("%s: write reached B", what);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct PageMapEntry ent = { A, C, PTE_P|PTE_U|PTE_W };
+	envid_t who;
+	int r;
+
+	cow_pair(1);
+	if ((r = sys_page_map(0, A, 0, C, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_map of a copy-on-write page: %e", r);
+	check_broken("sys_page_map", 1);
+
+	cow_pair(3);
+	if ((r = sys_page_map_batch(0, 0, &ent, 1)) != 1)
+		panic("sys_page_map_batch of a copy-on-write page: %e", r);
+	check_broken("sys_page_map_batch", 3);
+
+	// A page that is simply read-only still can't be made writable
+	if ((r = sys_page_alloc(0, D, PTE_P|PTE_U)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((r = sys_page_map(0, D, 0, C, PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("sys_page_map of a read-only page returned %e", r);
+	ent.pme_srcva = D;
+	if ((r = sys_page_map_batch(0, 0, &ent, 1)) != -E_INVAL)
+		panic("sys_page_map_batch of a read-only page returned %e", r);
+
+	// The child writes through the page we send it
+	cow_pair(5);
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		ipc_recv(NULL, RECV, NULL);
+		*RECV = 6;
+		ipc_send(thisenv->env_parent_id, 0, NULL, 0);
+		return;
+	}
+	ipc_send(who, 0, A, PTE_P|PTE_U|PTE_W);
+	ipc_recv(NULL, NULL, NULL);
+	if (*A != 6)
+		panic("sys_ipc_try_send: A and the child do not share a page");
+	if (*B != 5)
+		panic("sys_ipc_try_send: write reached B");
+
+	cprintf("testpagemap: OK\n");
+}
@@ -0,0 +1,51 @@
+// Test user stacks that grow on demand below USTACKTOP.
+
+#include <inc/lib.h>
+
+#define FRAME	(8 * 1024)
+
+// Use about depth * FRAME bytes of stack, checking that each frame
+// still holds what was written to it once the deeper calls return.
+static int
+recurse(int depth)
+{
+	volatile char buf[FRAME];
+	int i, sum;
+
+	for (i = 0; i < FRAME; i += 512)
+		buf[i] = depth + i;
+	sum = depth > 0 ? recurse(depth - 1) : 0;
+	for (i = 0; i < FRAME; i += 512)
+		if (buf[i] != (char) (depth + i))
+			panic("frame at depth %d corrupted", depth);
+	return sum + 1;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uintptr_t limit = USTACKTOP - USTACKSIZE;
+	int r;
+
+	// Half the default stack needs no help from the user
+	if ((r = recurse(USTACKSIZE / FRAME / 2)) != USTACKSIZE / FRAME / 2 + 1)
+		panic("recurse returned %d", r);
+	if (!(uvpt[PGNUM(limit + USTACKSIZE / 2)] & PTE_P))
+		panic("stack did not grow");
+
+	// Nothing may be placed in the guard gap below the stack
+	if ((r = sys_mmap_anon(0, (void *) (limit - PGSIZE), PGSIZE,
+			       PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("sys_mmap_anon in the guard gap returned %e", r);
+	if ((r = sys_env_set_stack_limit(0, USTACKMAX + PGSIZE)) != -E_INVAL)
+		panic("oversized stack limit returned %e", r);
+
+	// A larger limit lets the stack grow past the default size
+	if ((r = sys_env_set_stack_limit(0, 4 * USTACKSIZE)) < 0)
+		panic("sys_env_set_stack_limit: %e", r);
+	recurse(2 * USTACKSIZE / FRAME);
+	if (!(uvpt[PGNUM(limit - PGSIZE)] & PTE_P))
+		panic("stack did not grow past the default limit");
+
+	cprintf("teststack: OK\n");
+}